@@ -40,7 +40,80 @@
 #define START_DMA _IOWR(0xCC, 2, unsigned long)
 #define SET_SIZE _IOW(0xCC, 5, unsigned long)
 #define FLUSH _IO(0xCC, 4)
+#define BIND_RING _IOR(0xCC, 6, unsigned long)
+#define RING_DOORBELL _IO(0xCC, 7)
+#define GET_NODE _IOR(0xCC, 8, unsigned long)
+#define GET_LAT_HIST _IOR(0xCC, 9, unsigned long)
+#define SET_POLL _IOW(0xCC, 10, unsigned long)
+#define RING_WAIT _IOW(0xCC, 11, unsigned long)
 
 #define BUFFER_SIZE 124
+#define NUM_BUFFER 8
 #define GRAPHICS_ON 1
 #define GRAPHICS_OFF 0
+
+//Video mode set by VMODE GRAPHICS_ON (0xF888 pixels, 4 bytes each)
+#define FRAME_WIDTH 1024
+#define FRAME_HEIGHT 768
+#define FRAME_PITCH 4096
+
+#include <linux/types.h>
+
+//Entries in each ring, must be a power of two
+#define RING_ENTRIES 64
+
+//Submission entry flag: serve ahead of bulk traffic
+#define K2_SQE_URGENT 0x1
+
+//Submission entry, posted by userspace
+struct k2_sqe {
+  unsigned int buffer;
+  unsigned int length;
+  unsigned int flags;
+  unsigned int user_data;
+  //CLOCK_MONOTONIC time of posting in ns, for the latency histograms
+  __u64 submit_ns;
+};
+
+//Completion entry, posted by the driver from the interrupt handler
+struct k2_cqe {
+  unsigned int seq;
+  unsigned int buffer;
+  int result;
+  unsigned int user_data;
+};
+
+/*
+ * Page shared between driver and userspace by BIND_RING. Indices are free
+ * running and masked with RING_ENTRIES-1. Userspace owns sq_tail and
+ * cq_head, the driver owns the rest. 'idle' is set by the driver when it
+ * found nothing to launch; userspace must then ring RING_DOORBELL.
+ */
+struct k2_rings {
+  unsigned int sq_head;
+  unsigned int sq_tail;
+  unsigned int cq_head;
+  unsigned int cq_tail;
+  unsigned int idle;
+  unsigned int seq;
+  __u64 buffer_addr[NUM_BUFFER];
+  struct k2_sqe sq[RING_ENTRIES];
+  struct k2_cqe cq[RING_ENTRIES];
+};
+
+//NUMA placement reported by GET_NODE (node -1 if the card has none)
+struct k2_node_info {
+  int node;
+  unsigned int remote_buffers;
+};
+
+//Priority classes, START_DMA buffers are always bulk
+#define K2_CLASS_URGENT 0
+#define K2_CLASS_BULK 1
+#define K2_CLASSES 2
+
+//Queue-to-completion latency per class, bucket i counts times below 2^i us
+#define LAT_BUCKETS 24
+struct k2_lat_hist {
+  unsigned int bucket[K2_CLASSES][LAT_BUCKETS];
+};
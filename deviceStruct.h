@@ -16,14 +16,51 @@
 #include <linux/interrupt.h>
 #include <linux/spinlock.h>
 #include <linux/cred.h>
+#include <linux/ktime.h>
+#include <linux/slab.h>
 
 #define PCI_VENDOR_ID_CCORSI 0x1234
 #define PCI_DEVICE_ID_KYOUKO2 0x1113
 
-#define NUM_BUFFER 8
+//Urgent launches in a row allowed while bulk work waits
+#define URGENT_BURST 4
+
+//First mmap offset tried for the rings page; moved up a page at a time
+//while it equals a DMA buffer bus address
+#define RING_OFFSET 0x40000000
+
+//Submissions up to this many bytes may be merged into one transfer
+#define COALESCE_THRESHOLD 4096
+//Size of a merged transfer; bounds how long the first submission in it
+//waits on the others
+#define COALESCE_MAX_BYTES 16384
+//Submissions per merged transfer
+#define COALESCE_MAX 16
+
+//Longest busy-poll SET_POLL accepts, in microseconds
+#define POLL_MAX_US 1000
+
+//What the card is transferring right now
+#define K2_IDLE 0
+#define K2_LEGACY 1
+#define K2_RING 2
 
 struct cdev kyouko2_cdev;
 
+/*
+ * A submission waiting for, or riding in, a transfer
+ *
+ */
+
+struct k2_pending {
+  unsigned int buffer;
+  unsigned int length;
+  unsigned int seq;
+  unsigned int user_data;
+  ktime_t queued;
+  int result;
+};
+
 /*
  *This struct stores all the information and flags 
  *we need to store for the driver
@@ -37,6 +74,9 @@ struct kyouko2{
   unsigned long controlLen;
   unsigned long ramLen;
   struct pci_dev *dev;
+  //NUMA node the card hangs off, and DMA buffers that did not land there
+  int node;
+  unsigned int remote_buffers;
 
   unsigned long buffsize;
 
@@ -45,9 +85,49 @@ struct kyouko2{
   unsigned int fill;
   unsigned int drain;
 
+  //Transfer in flight and the submissions merged into it
+  unsigned int inflight;
+  unsigned int inflight_class;
+  unsigned int inflight_n;
+  struct k2_pending inflight_list[COALESCE_MAX];
+
+  //Staging buffer all transfers launch from, and submissions merged so far
+  unsigned int *k_staging;
+  dma_addr_t p_staging;
+  unsigned int coalesced;
+
+  //Urgent launches since bulk work last got the card
+  unsigned int urgent_run;
+  //Ring entries pulled into the lanes and not completed yet
+  unsigned int ring_outstanding;
+  struct k2_lat_hist lat;
+
+  //Waiters asleep on dma_snooze, and whether one waiter is busy-polling
+  unsigned int sleepers;
+  unsigned int polling;
+
+  //Shared rings page and the driver's private copies of its indices
+  struct k2_rings *rings;
+  //mmap offset of the rings page, never equal to a DMA buffer bus address
+  unsigned long ring_offset;
+  __u64 u_rings_addr;
+  unsigned int sq_head;
+  unsigned int cq_tail;
+  unsigned int seq;
+
   uid_t current_user;
 }k2;
 
+/*
+ * Per open file settings
+ *
+ */
+
+struct k2_context {
+  //Busy-poll budget in microseconds when waiting, 0 sleeps on the interrupt
+  unsigned int poll_us;
+};
+
 /*
  * This struct holds the informations/addresses for each buffer 
  *
@@ -56,10 +136,22 @@ struct kyouko2{
 struct dma_buff {
   unsigned int* k_dma_base;
   dma_addr_t p_dma_base;
-  unsigned int u_buffer_addr;
+  unsigned long u_buffer_addr;
   int count;
+  ktime_t queued;
 }buff_queue[NUM_BUFFER];
 
+/*
+ * Ring entries waiting for the card, one lane per priority class
+ *
+ */
+
+struct k2_lane {
+  struct k2_pending entry[RING_ENTRIES];
+  unsigned int head;
+  unsigned int tail;
+}lanes[K2_CLASSES];
+
 int k2_queue_full = 0;
 unsigned long flags;
 int tri=0;
@@ -0,0 +1,78 @@
+/*
+ * ################################################################
+   File: dmaCheck.h
+   Purpose: Validation of kyouko2_dma_header command streams. Shared
+	by the driver (START_DMA) and tester.c (benchmark), so it only
+	uses plain C types. Include after defs.h.
+   Team: Ben Whetstone, Ravi Mandliya
+   ################################################################
+*/
+
+#ifndef DMA_CHECK_H
+#define DMA_CHECK_H
+
+//Header word layout (see struct kyouko2_dma_header in tester.c)
+#define DMA_HDR_STRIDE(h) ((h) & 0x1f)
+#define DMA_HDR_HAS_V4(h) (((h) >> 5) & 0x1)
+#define DMA_HDR_HAS_C3(h) (((h) >> 6) & 0x1)
+#define DMA_HDR_HAS_C4(h) (((h) >> 7) & 0x1)
+#define DMA_HDR_PRIM(h) (((h) >> 12) & 0x3)
+#define DMA_HDR_COUNT(h) (((h) >> 14) & 0x3ff)
+#define DMA_HDR_OPCODE(h) (((h) >> 24) & 0xff)
+
+//Only opcode the card understands: draw vertices
+#define DMA_OP_DRAW 0x14
+
+//Results of dma_check_stream
+#define DMA_CHECK_OK 0
+#define DMA_CHECK_LENGTH 1
+#define DMA_CHECK_OPCODE 2
+#define DMA_CHECK_FORMAT 3
+#define DMA_CHECK_COUNT 4
+#define DMA_CHECK_OVERRUN 5
+
+/*
+ * Walks the command stream of 'bytes' bytes at 'buf'. Only header words
+ * are read, payload is skipped, so the cost grows with the number of
+ * commands and not with the size of the buffer.
+ */
+static inline int dma_check_stream(const unsigned int *buf, unsigned int bytes) {
+  unsigned int words, pos, hdr, vwords, count;
+
+  //Byte count must be whole words and fit in one DMA buffer
+  if(bytes == 0 || (bytes & 3) || bytes > BUFFER_SIZE*1024)
+    return DMA_CHECK_LENGTH;
+
+  words = bytes >> 2;
+  pos = 0;
+  while(pos < words) {
+    hdr = buf[pos];
+
+    if(DMA_HDR_OPCODE(hdr) != DMA_OP_DRAW)
+      return DMA_CHECK_OPCODE;
+
+    //A vertex carries either an RGB or an RGBA color, never both
+    if(DMA_HDR_HAS_C3(hdr) && DMA_HDR_HAS_C4(hdr))
+      return DMA_CHECK_FORMAT;
+
+    //Words per vertex: XYZ, optional W, optional color
+    vwords = 3 + DMA_HDR_HAS_V4(hdr) + 3*DMA_HDR_HAS_C3(hdr) + 4*DMA_HDR_HAS_C4(hdr);
+
+    //Stride must agree with the flags (vertex words - 1, as tester.c packs it)
+    if(DMA_HDR_STRIDE(hdr) != vwords - 1)
+      return DMA_CHECK_FORMAT;
+
+    count = DMA_HDR_COUNT(hdr);
+    if(count == 0)
+      return DMA_CHECK_COUNT;
+
+    //Payload must end inside the submitted byte count
+    if(count > (words - pos - 1) / vwords)
+      return DMA_CHECK_OVERRUN;
+
+    pos += 1 + count*vwords;
+  }
+  return DMA_CHECK_OK;
+}
+
+#endif
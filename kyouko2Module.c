@@ -9,6 +9,7 @@
 
 #include "defs.h"
 #include "deviceStruct.h"
+#include "dmaCheck.h"
 
 
 MODULE_LICENSE("Proprietary");
@@ -43,6 +44,11 @@ void K_SYNC(void) {
 //Open kyouko 2 device 
 int kyouko2_open(struct inode *inode, struct file *fp){
   printk(KERN_ALERT "Kyouko2 opened\n");
+  //Waits sleep on the interrupt until SET_POLL says otherwise
+  fp->private_data = kzalloc(sizeof(struct k2_context), GFP_KERNEL);
+  if(!fp->private_data)
+    return -ENOMEM;
+
   //Map control registers and RAM to kernel space
   k2.k_control_base = ioremap_nocache(k2.p_control_base,k2.controlLen);
   k2.k_ram_base = ioremap_nocache(k2.p_ram_base,k2.ramLen);	
@@ -51,6 +57,8 @@ int kyouko2_open(struct inode *inode, struct file *fp){
   k2.dma_mapped = 0;
   k2.graphics_on = 0;
   k2.buffsize=0;
+  k2.inflight = K2_IDLE;
+  k2.rings = NULL;
   
   // Init DMA buffers processed count 
   draino=0;
@@ -59,12 +67,15 @@ int kyouko2_open(struct inode *inode, struct file *fp){
    * if user can mmap control registers and RAM
    */
   k2.current_user=current_fsuid();
+  k2.sleepers = 0;
+  k2.polling = 0;
   
   return 0;
 }
 // Mmap into userspace
 int kyouko2_mmap(struct file *fp, struct vm_area_struct *vma){
   int ret = -1;
+  int i;
   //Control register case (page offset = 0) 
  	if(((vma->vm_pgoff)<<PAGE_SHIFT) == 0) {
     //Checks if root user
@@ -81,11 +92,29 @@ int kyouko2_mmap(struct file *fp, struct vm_area_struct *vma){
       printk(KERN_ALERT "Must be root to access framebuffer\n");
       return ret;
     }
-    //Map kernel RAM memory region into process address space
-   	ret = io_remap_pfn_range(vma, vma->vm_start, k2.p_ram_base>>PAGE_SHIFT, k2.ramLen, vma->vm_page_prot);
+    //Map kernel RAM memory region into process address space, write-combined
+    //so wide stores from userspace reach the card as bursts
+   	ret = io_remap_pfn_range(vma, vma->vm_start, k2.p_ram_base>>PAGE_SHIFT, k2.ramLen, pgprot_writecombine(vma->vm_page_prot));
+  }
+  //Submission/completion rings case (page offset = k2.ring_offset)
+  else if (k2.rings && ((vma->vm_pgoff)<<PAGE_SHIFT) == k2.ring_offset) {
+    //Map the shared rings page into process address space
+    ret = remap_pfn_range(vma, vma->vm_start, virt_to_phys(k2.rings)>>PAGE_SHIFT, PAGE_SIZE, vma->vm_page_prot);
   }
-  //DMA case (offset=physical bus address)
+  //DMA case (offset=physical bus address of one of our buffers)
   else {
+    for(i = 0; i < NUM_BUFFER; ++i)
+      if(buff_queue[i].k_dma_base && ((vma->vm_pgoff)<<PAGE_SHIFT) == buff_queue[i].p_dma_base)
+        break;
+    if(i == NUM_BUFFER) {
+      printk(KERN_ALERT "mmap offset is not a DMA buffer\n");
+      return -EINVAL;
+    }
+    //Nothing past the end of the buffer may be mapped
+    if((vma->vm_end)-(vma->vm_start) > BUFFER_SIZE*1024) {
+      printk(KERN_ALERT "mmap longer than a DMA buffer\n");
+      return -EINVAL;
+    }
     //Map kernel DMA memory region into process address space
     ret = remap_pfn_range(vma, vma->vm_start, vma->vm_pgoff, (vma->vm_end)-(vma->vm_start), vma->vm_page_prot);
   }
@@ -96,59 +125,430 @@ int kyouko2_mmap(struct file *fp, struct vm_area_struct *vma){
 //Inits wait queue structure
 DECLARE_WAIT_QUEUE_HEAD(dma_snooze);
 
-//Helper function for starting DMA transfers
-void init_transfer(void) {
-  int notdone=1;
-  //Get lock and disable interrupt (save interrupt config in flags)
-  spin_lock_irqsave(&k2_lock, flags);
+//Point the card at a DMA bus address. Caller holds k2_lock.
+void k2_launch(dma_addr_t addr, unsigned int count) {
+  //Sync to make sure previous writes to regs have completed
+  K_SYNC();
 
-  //DMA buffers empty and not processing so can start immediately
-  if(k2.fill==k2.drain) { 
-    //Increment fill
-    k2.fill=(k2.fill + 1) % NUM_BUFFER;
-    //Release lock and restore interrupts
-    spin_unlock_irqrestore(&k2_lock, flags);
+  //Write to reg to initiate DMA transfer
+  K_WRITE_REG(Buffer_Address, addr);
+  K_WRITE_REG(Buffer_Config, count);
 
-    //Write to registers to start DMA
-    tri++;
-    K_WRITE_REG(Buffer_Address, buff_queue[k2.drain].p_dma_base);
-    K_WRITE_REG(Buffer_Config, buff_queue[k2.drain].count);
-    
-    // Increment number of buffers processed
-    draino++;
+  //Increment DMA buffers drawn counter
+  draino++;
+
+  //Card is busy, userspace needs no doorbell
+  if(k2.rings)
+    k2.rings->idle = 0;
+}
+
+//Whether a submission of 'len' bytes may join a merged transfer of 'bytes'
+int k2_mergeable(unsigned int bytes, unsigned int len) {
+  return len <= COALESCE_THRESHOLD && bytes + len <= COALESCE_MAX_BYTES;
+}
+
+/*
+ * Launch the 'n' submissions collected in inflight_list. Userspace keeps
+ * its DMA buffers mapped and writable, so the card is only ever pointed
+ * at the kernel-only staging buffer: submissions are copied there back
+ * to back and each copy is validated where it landed. Invalid ones are
+ * dropped (result -EINVAL) and the next copy overwrites them. Returns 0
+ * if nothing was launched. Caller holds k2_lock.
+ */
+int k2_launch_list(unsigned int n) {
+  struct k2_pending *p;
+  unsigned int i, valid = 0, off = 0;
+
+  k2.inflight_n = n;
+  for(i = 0; i < n; ++i) {
+    p = &k2.inflight_list[i];
+    memcpy((char *)k2.k_staging + off, buff_queue[p->buffer].k_dma_base, p->length);
+    if(dma_check_stream((unsigned int *)((char *)k2.k_staging + off), p->length) != DMA_CHECK_OK) {
+      printk_ratelimited(KERN_WARNING "kyouko2: dropped invalid command stream (%u bytes)\n", p->length);
+      p->result = -EINVAL;
+      continue;
+    }
+    p->result = 0;
+    off += p->length;
+    valid++;
   }
-  else {
-    //Increment fill
-    k2.fill=(k2.fill + 1) % NUM_BUFFER;
-    
-    //Set flag which indicates if buffers are full
-    if(k2.fill==k2.drain) 
-      k2_queue_full=1;
-    
-    //Loop to keep checking after waking up as queue may become full between awaking and returning from sleep
-    while(notdone){
-      //Buffer queue is not full, unset flag, and return
-      if(k2_queue_full == 0) {
-        notdone = 0;
+  if(!valid)
+    return 0;
+
+  k2.coalesced += valid - 1;
+  k2_launch(k2.p_staging, off);
+  return 1;
+}
+
+//Post a completion entry to the shared ring. Caller holds k2_lock.
+void k2_ring_complete(unsigned int seq, unsigned int buffer, unsigned int user_data, int result) {
+  struct k2_cqe *cqe = &(k2.rings->cq[k2.cq_tail & (RING_ENTRIES-1)]);
+
+  cqe->seq = seq;
+  cqe->buffer = buffer;
+  cqe->result = result;
+  cqe->user_data = user_data;
+
+  //Entry must be visible before the tail that publishes it
+  smp_wmb();
+  k2.cq_tail++;
+  k2.rings->cq_tail = k2.cq_tail;
+  k2.rings->seq = seq;
+}
+
+/*
+ * Move submissions from the shared ring into the priority lanes. Entries
+ * naming no buffer or a bad length are completed with -EINVAL right away. Returns the
+ * number of entries queued. Caller holds k2_lock.
+ */
+int k2_ring_pull(void) {
+  struct k2_sqe sqe;
+  struct k2_lane *lane;
+  struct k2_pending *p;
+  ktime_t now;
+  int i, queued = 0;
+
+  if(!k2.rings)
+    return 0;
+
+  //Bounded so a corrupted tail cannot keep us here
+  for(i = 0; i < RING_ENTRIES; ++i) {
+    if(ACCESS_ONCE(k2.rings->sq_tail) == k2.sq_head)
+      break;
+    //Keep room to report every entry we hold, wait for userspace to reap
+    if(k2.cq_tail - ACCESS_ONCE(k2.rings->cq_head) + k2.ring_outstanding >= RING_ENTRIES)
+      break;
+
+    //Read the entry only after seeing the tail that published it
+    smp_rmb();
+    sqe = k2.rings->sq[k2.sq_head & (RING_ENTRIES-1)];
+    k2.sq_head++;
+    k2.rings->sq_head = k2.sq_head;
+    k2.seq++;
+
+    //Contents are checked on the staged copy at launch, only the bounds here
+    if(sqe.buffer >= NUM_BUFFER || sqe.length == 0 || (sqe.length & 3) || sqe.length > BUFFER_SIZE*1024) {
+      k2_ring_complete(k2.seq, sqe.buffer, sqe.user_data, -EINVAL);
+      continue;
+    }
+
+    lane = &lanes[(sqe.flags & K2_SQE_URGENT) ? K2_CLASS_URGENT : K2_CLASS_BULK];
+    p = &(lane->entry[lane->tail & (RING_ENTRIES-1)]);
+    p->buffer = sqe.buffer;
+    p->length = sqe.length;
+    p->seq = k2.seq;
+    p->user_data = sqe.user_data;
+    //Latency counts from when userspace posted the entry; a stamp from the
+    //future (or none) is taken as now
+    now = ktime_get();
+    p->queued = ns_to_ktime(sqe.submit_ns);
+    if(sqe.submit_ns == 0 || ktime_before(now, p->queued))
+      p->queued = now;
+    lane->tail++;
+    k2.ring_outstanding++;
+    queued++;
+  }
+  return queued;
+}
+
+//Launch the oldest entry of a lane, merged with small ones queued behind it.
+//Returns 0 if it was rejected instead. Caller holds k2_lock.
+int k2_lane_launch(unsigned int cls) {
+  struct k2_lane *lane = &lanes[cls];
+  struct k2_pending *p;
+  unsigned int n = 0, bytes = 0;
+
+  while(lane->head != lane->tail && n < COALESCE_MAX) {
+    p = &(lane->entry[lane->head & (RING_ENTRIES-1)]);
+    if(n > 0 && !(k2_mergeable(0, k2.inflight_list[0].length) && k2_mergeable(bytes, p->length)))
+      break;
+    k2.inflight_list[n++] = *p;
+    bytes += p->length;
+    lane->head++;
+  }
+
+  k2.inflight = K2_RING;
+  k2.inflight_class = cls;
+  return k2_launch_list(n);
+}
+
+//Launch the oldest START_DMA buffer, merged with small ones queued behind it.
+//Returns 0 if it was rejected instead. Caller holds k2_lock.
+int k2_legacy_launch(void) {
+  unsigned int pending, n = 0, bytes = 0, idx = k2.drain;
+
+  pending = k2_queue_full ? NUM_BUFFER : (k2.fill + NUM_BUFFER - k2.drain) % NUM_BUFFER;
+  while(n < pending && n < COALESCE_MAX) {
+    if(n > 0 && !(k2_mergeable(0, k2.inflight_list[0].length) && k2_mergeable(bytes, buff_queue[idx].count)))
+      break;
+    k2.inflight_list[n].buffer = idx;
+    k2.inflight_list[n].length = buff_queue[idx].count;
+    k2.inflight_list[n].queued = buff_queue[idx].queued;
+    bytes += buff_queue[idx].count;
+    n++;
+    idx = (idx + 1) % NUM_BUFFER;
+  }
+
+  k2.inflight = K2_LEGACY;
+  k2.inflight_class = K2_CLASS_BULK;
+  return k2_launch_list(n);
+}
+
+//Count a finished transfer in its class histogram. Caller holds k2_lock.
+void k2_lat_record(unsigned int cls, ktime_t queued) {
+  s64 us = ktime_us_delta(ktime_get(), queued);
+  int b = us > 0 ? fls((int)min(us, (s64)0x7fffffff)) : 0;
+
+  if(b >= LAT_BUCKETS)
+    b = LAT_BUCKETS - 1;
+  k2.lat.bucket[cls][b]++;
+}
+
+/*
+ * Complete every submission in inflight_list, whether the card carried
+ * them or they were rejected at launch. Returns 1 if sleepers on
+ * dma_snooze should be woken. Caller holds k2_lock.
+ */
+int k2_retire(void) {
+  struct k2_pending *p;
+  unsigned int i;
+  int wake = 0;
+
+  for(i = 0; i < k2.inflight_n; ++i) {
+    p = &k2.inflight_list[i];
+    //Rejected submissions never reached the card
+    if(p->result == 0)
+      k2_lat_record(k2.inflight_class, p->queued);
+    if(k2.inflight == K2_RING) {
+      k2.ring_outstanding--;
+      k2_ring_complete(p->seq, p->buffer, p->user_data, p->result);
+      //Someone may be in RING_WAIT
+      wake = 1;
+    }
+  }
+
+  if(k2.inflight == K2_LEGACY) {
+    //Increment drain past every merged buffer
+    k2.drain=(k2.drain + k2.inflight_n) % NUM_BUFFER;
+    //If user is waiting on not full then wake them up
+    if(k2_queue_full) {
+      k2_queue_full = 0;
+      wake = 1;
+    }
+  }
+  k2.inflight = K2_IDLE;
+  return wake;
+}
+
+/*
+ * Start the next queued transfer if the card is idle. Urgent ring entries
+ * go first, but after URGENT_BURST of them in a row waiting bulk work
+ * (START_DMA buffers, then bulk ring entries) gets one turn. Small
+ * submissions already queued in the chosen lane are merged into one
+ * transfer; nothing is held back waiting for more to arrive. Submissions
+ * rejected at launch are retired and the next one is tried. Returns 1 if
+ * sleepers on dma_snooze should be woken. Caller holds k2_lock.
+ */
+int k2_dispatch(void) {
+  int urgent, legacy, ring, bulk, wake = 0;
+  unsigned int rejected = 0;
+
+  while(k2.inflight == K2_IDLE) {
+    //Rejected work launches nothing, so nothing bounds this loop but the
+    //rings, which userspace keeps refilling. Leave the rest to the next
+    //doorbell or interrupt instead of spinning here with interrupts off.
+    if(rejected >= RING_ENTRIES) {
+      if(k2.rings)
+        k2.rings->idle = 1;
+      break;
+    }
+
+    k2_ring_pull();
+
+    urgent = lanes[K2_CLASS_URGENT].head != lanes[K2_CLASS_URGENT].tail;
+    legacy = k2.fill != k2.drain || k2_queue_full;
+    ring = lanes[K2_CLASS_BULK].head != lanes[K2_CLASS_BULK].tail;
+    bulk = legacy || ring;
+
+    if(urgent && !(bulk && k2.urgent_run >= URGENT_BURST)) {
+      k2.urgent_run = bulk ? k2.urgent_run + 1 : 0;
+      if(!k2_lane_launch(K2_CLASS_URGENT)) {
+        wake |= k2_retire();
+        rejected++;
       }
-      //Buffer queue is full
-      else{
-        //Restore interrupts and release lock before sleeping (bad otherwise)
-        spin_unlock_irqrestore(&k2_lock, flags);
-        //Sleep until buffer no longer full
-        wait_event_interruptible(dma_snooze, k2_queue_full == 0);
-        //Get spinlock and disable interrupts before checking if queue is still not full
-        spin_lock_irqsave(&k2_lock, flags);
+      continue;
+    }
+    k2.urgent_run = 0;
+
+    //Bulk work: buffers queued through START_DMA, or bulk entries from the
+    //shared submission ring. BIND_RING and START_DMA exclude each other,
+    //so at most one of the two has work
+    if(legacy) {
+      if(!k2_legacy_launch()) {
+        wake |= k2_retire();
+        rejected++;
+      }
+      continue;
+    }
+    if(ring) {
+      if(!k2_lane_launch(K2_CLASS_BULK)) {
+        wake |= k2_retire();
+        rejected++;
       }
+      continue;
     }
-    //Restore flags and release lock before returning
+
+    if(!k2.rings)
+      break;
+
+    //Nothing to launch: tell userspace to ring the doorbell, then look again
+    //in case an entry was posted before it could see the flag
+    k2.rings->idle = 1;
+    smp_mb();
+    if(!k2_ring_pull())
+      break;
+  }
+  return wake;
+}
+
+/*
+ * Finish the transfer the card just reported and launch the next one.
+ * Returns 1 if sleepers on dma_snooze should be woken. Caller holds k2_lock.
+ */
+int k2_complete(void) {
+  int wake = 0;
+
+  if(k2.inflight != K2_IDLE)
+    wake = k2_retire();
+  return k2_dispatch() | wake;
+}
+
+//Wait condition: START_DMA ring has a free buffer
+int k2_not_full(unsigned long unused) {
+  return k2_queue_full == 0;
+}
+
+//Wait condition: at least 'want' completions waiting to be reaped
+int k2_cq_ready(unsigned long want) {
+  return k2.rings && k2.cq_tail - ACCESS_ONCE(k2.rings->cq_head) >= want;
+}
+
+/*
+ * Busy-poll instead of sleeping on dma_snooze. Config_Interrupt masks the
+ * DMA interrupt for the whole card, not just this waiter, so polling is
+ * only done while nobody sleeps on the interrupt: one poller at a time,
+ * and it gives up as soon as someone goes to sleep. It also stops when
+ * done(arg) holds, budget_us runs out, or the CPU is wanted elsewhere.
+ * Returns done(arg). Called without k2_lock.
+ */
+int k2_busy_poll(unsigned int budget_us, int (*done)(unsigned long), unsigned long arg) {
+  ktime_t end = ktime_add_us(ktime_get(), budget_us);
+  int others;
+
+  spin_lock_irqsave(&k2_lock, flags);
+  if(k2.polling || k2.sleepers) {
+    spin_unlock_irqrestore(&k2_lock, flags);
+    return done(arg);
+  }
+  k2.polling = 1;
+  K_WRITE_REG(Config_Interrupt, 0);
+  spin_unlock_irqrestore(&k2_lock, flags);
+
+  while(!done(arg) && ktime_before(ktime_get(), end)) {
+    if(need_resched() || signal_pending(current))
+      break;
+    spin_lock_irqsave(&k2_lock, flags);
+    if(K_READ_REG(Info_Status) & 0x02) {
+      K_WRITE_REG(Info_Status, 0xf);
+      k2_complete();
+    }
+    others = k2.sleepers;
+    spin_unlock_irqrestore(&k2_lock, flags);
+    //A sleeper needs the interrupt back
+    if(others)
+      break;
+    cpu_relax();
+  }
+
+  //Unmask, then look once more: a transfer that finished while masked
+  //may never raise its interrupt
+  spin_lock_irqsave(&k2_lock, flags);
+  k2.polling = 0;
+  K_WRITE_REG(Config_Interrupt, 2);
+  if(K_READ_REG(Info_Status) & 0x02) {
+    K_WRITE_REG(Info_Status, 0xf);
+    k2_complete();
+  }
+  spin_unlock_irqrestore(&k2_lock, flags);
+
+  //Others may be sleeping on what we retired
+  wake_up_interruptible(&dma_snooze);
+  return done(arg);
+}
+
+/*
+ * Sleep on dma_snooze until done(arg) holds. Counted in k2.sleepers so a
+ * busy-poller hands the interrupt back. Returns wait_event_interruptible's
+ * result. Called without k2_lock.
+ */
+int k2_sleep(int (*done)(unsigned long), unsigned long arg) {
+  int ret;
+
+  spin_lock_irqsave(&k2_lock, flags);
+  k2.sleepers++;
+  spin_unlock_irqrestore(&k2_lock, flags);
+
+  ret = wait_event_interruptible(dma_snooze, done(arg));
+
+  spin_lock_irqsave(&k2_lock, flags);
+  k2.sleepers--;
+  spin_unlock_irqrestore(&k2_lock, flags);
+  return ret;
+}
+
+//Helper function for starting DMA transfers
+int init_transfer(struct k2_context *ctx) {
+  //Get lock and disable interrupt (save interrupt config in flags)
+  spin_lock_irqsave(&k2_lock, flags);
+
+  //BIND_RING may have won the race since START_DMA looked
+  if(k2.rings) {
     spin_unlock_irqrestore(&k2_lock, flags);
+    return -EBUSY;
   }
+
+  //Stamp buffer for the bulk latency histogram
+  buff_queue[k2.fill].queued = ktime_get();
+
+  //Increment fill
+  k2.fill=(k2.fill + 1) % NUM_BUFFER;
+
+  //Set flag which indicates if buffers are full
+  if(k2.fill==k2.drain)
+    k2_queue_full=1;
+
+  //Starts the buffer right away if the card is idle
+  k2_dispatch();
+
+  //Loop to keep checking after waking up as queue may become full between awaking and returning from sleep
+  while(k2_queue_full) {
+    //Restore interrupts and release lock before sleeping (bad otherwise)
+    spin_unlock_irqrestore(&k2_lock, flags);
+    //Poll for a free buffer if asked to, sleep until buffer no longer full otherwise
+    if(!(ctx->poll_us && k2_busy_poll(ctx->poll_us, k2_not_full, 0)))
+      k2_sleep(k2_not_full, 0);
+    //Get spinlock and disable interrupts before checking if queue is still not full
+    spin_lock_irqsave(&k2_lock, flags);
+  }
+  //Restore flags and release lock before returning
+  spin_unlock_irqrestore(&k2_lock, flags);
+  return 0;
 }
 
 //DMA interrupt handler
 irqreturn_t dma_intr(int irq, void *dev_id, struct pt_regs *regs) {
   unsigned int iflags;
+  int wake;
   
   spin_lock_irqsave(&k2_lock, flags);
   //Save GPU interrupts
@@ -162,30 +562,13 @@ irqreturn_t dma_intr(int irq, void *dev_id, struct pt_regs *regs) {
     spin_unlock_irqrestore(&k2_lock, flags);
     return IRQ_NONE;
   }
-  //Otherwise, interrupt is valid
+  //Otherwise, interrupt is valid: retire the buffer and launch the next one
   else {
-    
-    //Increment drain
-    k2.drain=(k2.drain+1) % NUM_BUFFER;
-
-    //If buffer ring is not empty, launch next buffer
-    if(!(k2.fill == k2.drain && k2_queue_full==0)) {
-      //Sync to make sure previous writes to regs have completed
-      K_SYNC();
-      
-      //Write to reg to initiate DMA transfer
-      K_WRITE_REG(Buffer_Address, buff_queue[k2.drain].p_dma_base);
-      K_WRITE_REG(Buffer_Config, buff_queue[k2.drain].count);
-
-      //Increment DMA buffers drawn counter
-      draino++;
-    }
+    wake = k2_complete();
     spin_unlock_irqrestore(&k2_lock, flags);
-    //If user is waiting on not full then wake them up
-    if(k2_queue_full) {
-        k2_queue_full = 0;
-        wake_up_interruptible(&dma_snooze);
-    } 
+
+    if(wake)
+      wake_up_interruptible(&dma_snooze);
     return IRQ_HANDLED;
   }
 }
@@ -196,19 +579,19 @@ long kyouko2_ioctl(struct file *fp, unsigned int cmd, unsigned long arg) {
     {
       if (arg == GRAPHICS_ON) {
         //Set X resolution
-        K_WRITE_REG(Frame_Col, 1024);
+        K_WRITE_REG(Frame_Col, FRAME_WIDTH);
         //Set Y resolution
-        K_WRITE_REG(Frame_Row, 768);
+        K_WRITE_REG(Frame_Row, FRAME_HEIGHT);
         //Set frame pitch
-        K_WRITE_REG(Frame_Pitch, 4096);
+        K_WRITE_REG(Frame_Pitch, FRAME_PITCH);
         //Set pixel type
         K_WRITE_REG(Frame_Pixel, 0xF888);
         //Set start of framebuffer
         K_WRITE_REG(Frame_Start, 0x0);
         
         //Set resolution for encoder
-        K_WRITE_REG(Encoder_Width, 1024);
-        K_WRITE_REG(Encoder_Height, 768);
+        K_WRITE_REG(Encoder_Width, FRAME_WIDTH);
+        K_WRITE_REG(Encoder_Height, FRAME_HEIGHT);
         //Set offsets for encoder
         K_WRITE_REG(Encoder_OffX, 0);
         K_WRITE_REG(Encoder_OffY, 0);
@@ -266,17 +649,50 @@ long kyouko2_ioctl(struct file *fp, unsigned int cmd, unsigned long arg) {
     {
       int i;
       int result;
+      //Legacy callers take 32-bit buffer addresses
+      unsigned int uaddr;
 
       //Set default fill and drain
       k2.fill = 0;
       k2.drain = 0;
+      k2.inflight = K2_IDLE;
+      k2.urgent_run = 0;
+      memset(&k2.lat, 0, sizeof(k2.lat));
       
-      //Alloc room in kernelspace for DMA buffers and save bus address
+      //Alloc room in kernelspace for DMA buffers and save bus address.
+      //The coherent allocator takes pages from dev_to_node(), check it did
+      k2.remote_buffers = 0;
       for(i = 0; i < NUM_BUFFER; ++i) {
         buff_queue[i].k_dma_base = pci_alloc_consistent(k2.dev, BUFFER_SIZE*1024, &(buff_queue[i].p_dma_base));
+        if(!buff_queue[i].k_dma_base) {
+          printk(KERN_ALERT "Unable to allocate DMA buffer %d\n", i);
+          while(--i >= 0) {
+            pci_free_consistent(k2.dev, BUFFER_SIZE*1024, buff_queue[i].k_dma_base, buff_queue[i].p_dma_base);
+            buff_queue[i].k_dma_base = NULL;
+          }
+          return -ENOMEM;
+        }
         buff_queue[i].count = 0;
+        //Coherent memory may be remapped (vmalloc space), which has no
+        //struct page to ask for a node; only count what can be checked
+        if(k2.node != NUMA_NO_NODE && virt_addr_valid(buff_queue[i].k_dma_base) &&
+           page_to_nid(virt_to_page(buff_queue[i].k_dma_base)) != k2.node)
+          k2.remote_buffers++;
       }
+      if(k2.remote_buffers)
+        printk(KERN_WARNING "%u DMA buffers not on card node %d\n", k2.remote_buffers, k2.node);
       
+      //Kernel-only staging buffer every transfer is launched from
+      k2.coalesced = 0;
+      k2.k_staging = pci_alloc_consistent(k2.dev, BUFFER_SIZE*1024, &(k2.p_staging));
+      if(!k2.k_staging) {
+        for(i = 0; i < NUM_BUFFER; ++i) {
+          pci_free_consistent(k2.dev, BUFFER_SIZE*1024, buff_queue[i].k_dma_base, buff_queue[i].p_dma_base);
+          buff_queue[i].k_dma_base = NULL;
+        }
+        return -ENOMEM;
+      }
+
       //Mmap kernel DMA buffer to user space
       for(i = 0; i < NUM_BUFFER; ++i) {
         buff_queue[i].u_buffer_addr = do_mmap(fp, ((unsigned long)(buff_queue[i].p_dma_base)),BUFFER_SIZE*1024, PROT_READ|PROT_WRITE, MAP_SHARED, buff_queue[i].p_dma_base);
@@ -293,12 +709,16 @@ long kyouko2_ioctl(struct file *fp, unsigned int cmd, unsigned long arg) {
       //Configuring interrupt to occur when the buffer flushes
       if(result == 0){
         K_WRITE_REG(Config_Interrupt,2);
+        //Steer the MSI vector to CPUs next to the card
+        if(k2.node != NUMA_NO_NODE)
+          irq_set_affinity_hint(k2.dev->irq, cpumask_of_node(k2.node));
       }
 
    // *((unsigned long *)arg)=buff_queue[0].u_buffer_addr;
       
       //Copy back the first DMA buffer to user
-      if( copy_to_user((int *) arg, &(buff_queue[0].u_buffer_addr), sizeof(unsigned int))){
+      uaddr = buff_queue[0].u_buffer_addr;
+      if( copy_to_user((int *) arg, &uaddr, sizeof(unsigned int))){
         printk(KERN_ALERT "copy_to_user failed\n");
       }
       //Set flag to indicate that DMA has been mapped to kernel and should be freed in close
@@ -309,24 +729,193 @@ long kyouko2_ioctl(struct file *fp, unsigned int cmd, unsigned long arg) {
     
     case START_DMA:
     {
-      
+      unsigned int count;
+      int check;
+      unsigned int uaddr;
+
+      //No buffers to launch from until BIND_DMA
+      if(!k2.dma_mapped)
+        return -EINVAL;
+
+      //Ring entries own the buffers once BIND_RING has been called
+      if(k2.rings)
+        return -EBUSY;
+
       //Get size of buffer to be processed
-      if(copy_from_user(&(buff_queue[k2.fill].count), (int __user *)arg, sizeof(unsigned int))){
+      if(copy_from_user(&count, (int __user *)arg, sizeof(unsigned int))){
         printk(KERN_WARNING "Error in copy from user\n");
+        return -EFAULT;
       }
 
+      //Early check so the caller hears about a bad buffer; the copy staged
+      //at launch is checked again since this buffer stays writable
+      check = dma_check_stream(buff_queue[k2.fill].k_dma_base, count);
+      if(check != DMA_CHECK_OK) {
+        printk_ratelimited(KERN_WARNING "START_DMA rejected buffer (count %u, error %d)\n", count, check);
+        //Hand the same buffer back so the caller can refill it
+        uaddr = buff_queue[k2.fill].u_buffer_addr;
+        if(copy_to_user((unsigned int *)arg, &uaddr, sizeof(unsigned int)))
+          printk(KERN_ALERT "copy_to_user failed \n");
+        return -EINVAL;
+      }
+      buff_queue[k2.fill].count = count;
+
       //Call processing function
-      init_transfer();
+      if(init_transfer(fp->private_data))
+        return -EBUSY;
       
       //*((unsigned long*)arg)=buff_queue[k2.fill].u_buffer_addr;
 
       //Copy back in arg the address of next buffer to be filled
-      if(copy_to_user((unsigned int *)arg, &(buff_queue[k2.fill].u_buffer_addr), sizeof(unsigned int)))
+      uaddr = buff_queue[k2.fill].u_buffer_addr;
+      if(copy_to_user((unsigned int *)arg, &uaddr, sizeof(unsigned int)))
         printk(KERN_ALERT "copy_to_user failed \n");
      
       break;
 		}
     
+    case BIND_RING:
+    {
+      struct k2_rings *rings;
+      struct page *page;
+      int i;
+
+      //Ring entries name DMA buffers, so those must exist first
+      if(!k2.dma_mapped)
+        return -EINVAL;
+
+      if(!k2.rings) {
+        //Rings are touched by the interrupt handler, keep them on the card node
+        page = alloc_pages_node(k2.node, GFP_KERNEL | __GFP_ZERO, 0);
+        if(!page)
+          return -ENOMEM;
+        rings = (struct k2_rings *) page_address(page);
+        //Keep the page pinned while it is mapped into userspace
+        SetPageReserved(virt_to_page(rings));
+
+        //Publish user addresses of all DMA buffers
+        for(i = 0; i < NUM_BUFFER; ++i)
+          rings->buffer_addr[i] = buff_queue[i].u_buffer_addr;
+
+        //Pick an mmap offset no other region of this device answers to
+        k2.ring_offset = RING_OFFSET;
+        for(i = 0; i < NUM_BUFFER; ++i) {
+          if(k2.ring_offset == 0 || k2.ring_offset == 0x80000000 || k2.ring_offset == buff_queue[i].p_dma_base) {
+            k2.ring_offset += PAGE_SIZE;
+            i = -1;
+          }
+        }
+
+        spin_lock_irqsave(&k2_lock, flags);
+        //Buffers handed out by START_DMA still belong to the legacy path
+        if(k2.fill != k2.drain || k2_queue_full) {
+          spin_unlock_irqrestore(&k2_lock, flags);
+          ClearPageReserved(virt_to_page(rings));
+          free_page((unsigned long)rings);
+          return -EBUSY;
+        }
+        k2.sq_head = 0;
+        k2.cq_tail = 0;
+        k2.seq = 0;
+        k2.ring_outstanding = 0;
+        for(i = 0; i < K2_CLASSES; ++i)
+          lanes[i].head = lanes[i].tail = 0;
+        rings->idle = (k2.inflight == K2_IDLE);
+        k2.rings = rings;
+        spin_unlock_irqrestore(&k2_lock, flags);
+
+        //Mmap rings page to user space
+        k2.u_rings_addr = do_mmap(fp, 0, PAGE_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, k2.ring_offset);
+      }
+
+      //Copy back user address of the rings
+      if(copy_to_user((__u64 *)arg, &(k2.u_rings_addr), sizeof(__u64)))
+        printk(KERN_ALERT "copy_to_user failed \n");
+
+      break;
+    }
+
+    case RING_DOORBELL:
+    {
+      if(!k2.rings)
+        return -EINVAL;
+
+      //Card went idle: pick up whatever userspace posted since
+      spin_lock_irqsave(&k2_lock, flags);
+      k2_dispatch();
+      spin_unlock_irqrestore(&k2_lock, flags);
+
+      //Entries rejected on the way in complete at once
+      wake_up_interruptible(&dma_snooze);
+
+      break;
+    }
+
+    case SET_POLL:
+    {
+      struct k2_context *ctx = fp->private_data;
+
+      //Budget in microseconds, 0 goes back to interrupt completions. Kept
+      //short since the interrupt stays masked for everyone meanwhile
+      ctx->poll_us = arg > POLL_MAX_US ? POLL_MAX_US : arg;
+
+      break;
+    }
+
+    case RING_WAIT:
+    {
+      struct k2_context *ctx = fp->private_data;
+
+      if(!k2.rings || arg == 0 || arg > RING_ENTRIES)
+        return -EINVAL;
+
+      //Entries a capped dispatch left behind get their launch now
+      spin_lock_irqsave(&k2_lock, flags);
+      if(k2_dispatch()) {
+        spin_unlock_irqrestore(&k2_lock, flags);
+        wake_up_interruptible(&dma_snooze);
+      }
+      else
+        spin_unlock_irqrestore(&k2_lock, flags);
+
+      //Wait until 'arg' completions are ready to be reaped
+      if(ctx->poll_us && k2_busy_poll(ctx->poll_us, k2_cq_ready, arg))
+        break;
+      if(k2_sleep(k2_cq_ready, arg))
+        return -ERESTARTSYS;
+
+      break;
+    }
+
+    case GET_NODE:
+    {
+      struct k2_node_info info;
+
+      info.node = k2.node;
+      info.remote_buffers = k2.remote_buffers;
+
+      //Copy back node so userspace can pin itself next to the card
+      if(copy_to_user((struct k2_node_info *)arg, &info, sizeof(info)))
+        return -EFAULT;
+
+      break;
+    }
+
+    case GET_LAT_HIST:
+    {
+      struct k2_lat_hist hist;
+
+      //Snapshot under the lock so both classes are from the same moment
+      spin_lock_irqsave(&k2_lock, flags);
+      hist = k2.lat;
+      spin_unlock_irqrestore(&k2_lock, flags);
+
+      if(copy_to_user((struct k2_lat_hist *)arg, &hist, sizeof(hist)))
+        return -EFAULT;
+
+      break;
+    }
+
     default:
     {
       break;
@@ -353,6 +942,10 @@ int kyouko2_probe(struct pci_dev *pci_dev, const struct pci_device_id  *pci_id){
   //Storing pci_dev struct
   k2.dev = pci_dev;
 
+  //Remember which NUMA node the card sits on
+  k2.node = dev_to_node(&pci_dev->dev);
+  k2.remote_buffers = 0;
+
   //Enable Kyouko2 card
   if(pci_enable_device(pci_dev)){
     printk(KERN_WARNING "Error in enabling PCI_DEVICE\n");
@@ -376,13 +969,14 @@ int kyouko2_release(struct inode *inode, struct file *fp){
   int intr;
 
   //Print buffers drawn  
-  printk(KERN_ALERT "Buffers drawn:%d\n", draino);
+  printk(KERN_ALERT "Buffers drawn:%d, merged away:%u\n", draino, k2.coalesced);
 
   //Print interrupt status on exit
   intr = K_READ_REG(Info_Status);
   printk(KERN_ALERT "Interrupt on exit: %x\n", intr);
 
-  //Disable interrupt handler
+  //Drop affinity hint and disable interrupt handler
+  irq_set_affinity_hint(k2.dev->irq, NULL);
   free_irq(k2.dev->irq,&k2);
 
   //Turn off MSI interrupts
@@ -392,9 +986,18 @@ int kyouko2_release(struct inode *inode, struct file *fp){
   if(k2.dma_mapped) {
     for(i=0;i<NUM_BUFFER;++i) {
       pci_free_consistent(k2.dev, BUFFER_SIZE*1024, buff_queue[i].k_dma_base, buff_queue[i].p_dma_base);
+      buff_queue[i].k_dma_base = NULL;
     }
+    pci_free_consistent(k2.dev, BUFFER_SIZE*1024, k2.k_staging, k2.p_staging);
   }
   
+  //Free shared rings page
+  if(k2.rings) {
+    ClearPageReserved(virt_to_page(k2.rings));
+    free_page((unsigned long)k2.rings);
+    k2.rings = NULL;
+  }
+
   //Free kernel RAM and control register address
   iounmap(k2.k_ram_base);		
   iounmap(k2.k_control_base);
@@ -404,6 +1007,9 @@ int kyouko2_release(struct inode *inode, struct file *fp){
 
   //Disable Kyouko2 pci device
   pci_disable_device(k2.dev);
+
+  //Free per file settings
+  kfree(fp->private_data);
   printk(KERN_ALERT "BUUH BYE\n");
   
   return 0;
@@ -9,6 +9,8 @@
 */
 
 //header files
+#define _GNU_SOURCE
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -21,9 +23,23 @@
 #include <sys/syscall.h>
 #include <stdint.h>
 #include <time.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+#ifdef __SSE2__
+//SSE4.1 is only used in functions built for it and picked at runtime
+#include <smmintrin.h>
+#endif
 
 //header file defining the device registers.
 #include "defs.h"
+//DMA command stream validator shared with the driver
+#include "dmaCheck.h"
 
 #define SIZE_BUFFER 124
 #define SCALE 1024
@@ -93,17 +109,19 @@ float color[3][3] = {
 
 //To read a register value
 unsigned int U_READ_REG( unsigned int regist){
-  return (*(k2.u_control_base+(regist>>2)));
+  //volatile so polling loops really go back to the card
+  return (*(volatile unsigned int *)(k2.u_control_base+(regist>>2)));
 }
 
 //To write to a register
 void U_WRITE_REG(unsigned int reg, unsigned int val) {
-  *(k2.u_control_base+(reg>>2))= val; 
+  //volatile so every store reaches the card, in program order
+  *(volatile unsigned int *)(k2.u_control_base+(reg>>2))= val; 
 }
 
 //To write a float value to a register
 void U_WRITE_REG_F(unsigned int reg, float val) {
-  *(k2.u_control_base+(reg>>2))= *(unsigned int *) (&val);
+  *(volatile unsigned int *)(k2.u_control_base+(reg>>2))= *(unsigned int *) (&val);
 }
 
 //To write to a frame buffer
@@ -112,59 +130,84 @@ void U_WRITE_FB(unsigned int off, unsigned int val) {
 }
 
 
-//A function to fill the FIFO commands 
-void fillFifoReg(int fd){
- 
-  U_WRITE_REG(Raster_Clear, 1);
+//USER Struct: free FIFO entries tracked as credits, so FIFO_Depth
+//(an uncached read that stalls the CPU) is only read when they run out
+struct fifo_credits{
+  unsigned int size;
+  unsigned int credits;
+  unsigned long refills;
+}fifo;
 
-  U_WRITE_REG(Raster_Prim, 1);
-  
-//Red Vertex
-  U_WRITE_REG_F(Vertex_X, -0.5);
-  U_WRITE_REG_F(Vertex_Y, -0.5);
-  U_WRITE_REG_F(Vertex_Z, 0.0);
-  U_WRITE_REG_F(Vertex_W, 1.0);
-
-  U_WRITE_REG_F(Vertex_R, 1.0);
-  U_WRITE_REG_F(Vertex_G, 0.0);
-  U_WRITE_REG_F(Vertex_B, 0.0);
-  U_WRITE_REG_F(Vertex_A, 0.0);
-
-//Emit
-  U_WRITE_REG(Raster_Emit, 0);
+//USER Array: the 8 vertex registers in the order fifoVertex takes its floats
+unsigned int vertexRegs[8] = {
+  Vertex_X, Vertex_Y, Vertex_Z, Vertex_W, Vertex_R, Vertex_G, Vertex_B, Vertex_A
+};
 
 
-//Green Vertex
-  U_WRITE_REG_F(Vertex_X, 0.5);
-  U_WRITE_REG_F(Vertex_Y, 0.0);
-  U_WRITE_REG_F(Vertex_Z, 0.0);
-  U_WRITE_REG_F(Vertex_W, 1.0);
+//Read FIFO size once and start with whatever is free right now
+void fifoInit(void){
+  fifo.size = U_READ_REG(Device_FIFOSize);
+  fifo.credits = fifo.size - U_READ_REG(FIFO_Depth);
+  fifo.refills = 0;
+}
 
-  U_WRITE_REG_F(Vertex_R, 0.0);
-  U_WRITE_REG_F(Vertex_G, 1.0);
-  U_WRITE_REG_F(Vertex_B, 0.0);
-  U_WRITE_REG_F(Vertex_A, 0.0);
 
-  U_WRITE_REG(Raster_Emit, 0);
+//Wait until 'n' FIFO entries are free, reading FIFO_Depth only when short of credits
+void fifoReserve(unsigned int n){
+  while(fifo.credits < n){
+    fifo.credits = fifo.size - U_READ_REG(FIFO_Depth);
+    fifo.refills++;
+  }
+  fifo.credits -= n;
+}
 
 
-//blue vertex
-  U_WRITE_REG_F(Vertex_X, 0.125);
-  U_WRITE_REG_F(Vertex_Y, 0.5);
-  U_WRITE_REG_F(Vertex_Z, 0.0);
-  U_WRITE_REG_F(Vertex_W, 1.0);
+//Write one register through the FIFO
+void fifoWrite(unsigned int reg, unsigned int val){
+  fifoReserve(1);
+  U_WRITE_REG(reg, val);
+}
 
-  U_WRITE_REG_F(Vertex_R, 0.0);
-  U_WRITE_REG_F(Vertex_G, 0.0);
-  U_WRITE_REG_F(Vertex_B, 1.0);
-  U_WRITE_REG_F(Vertex_A, 0.0);
 
+//Emit a whole vertex (XYZW RGBA + Raster_Emit) as one 9 entry unit
+void fifoVertex(const float v[8]){
+  int i;
+  fifoReserve(9);
+  for(i = 0; i < 8; ++i)
+    U_WRITE_REG_F(vertexRegs[i], v[i]);
   U_WRITE_REG(Raster_Emit, 0);
+}
 
-  ioctl(fd, SYNC);
 
-  U_WRITE_REG(Raster_Prim, 0);
-  U_WRITE_REG(Raster_Flush, 0);
+//Wait for the FIFO to drain without going through the SYNC ioctl
+void fifoSync(void){
+  while(U_READ_REG(FIFO_Depth));
+  fifo.credits = fifo.size;
+}
+
+
+//A function to fill the FIFO commands 
+void fillFifoReg(int fd){
+  //Red, green and blue vertex
+  float verts[3][8] = {
+    {-0.5, -0.5, 0.0, 1.0, 1.0, 0.0, 0.0, 0.0},
+    { 0.5,  0.0, 0.0, 1.0, 0.0, 1.0, 0.0, 0.0},
+    {0.125, 0.5, 0.0, 1.0, 0.0, 0.0, 1.0, 0.0}
+  };
+  int i;
+
+  fifoInit();
+
+  fifoWrite(Raster_Clear, 1);
+  fifoWrite(Raster_Prim, 1);
+
+  for(i = 0; i < 3; ++i)
+    fifoVertex(verts[i]);
+
+  fifoSync();
+
+  fifoWrite(Raster_Prim, 0);
+  fifoWrite(Raster_Flush, 0);
 }
 
 
@@ -254,6 +297,1279 @@ void drawTriangles(union buffer *buff, int pIndex){
 
 
 
+//USER pointer to the submission/completion rings shared with the driver
+volatile struct k2_rings *rings;
+
+
+//Switch graphics on and bind the DMA buffers and the rings. Returns -1,
+//with graphics off again, if the driver refused.
+int ringSetup(int fd){
+  __u64 ringAddr = 0;
+
+  ioctl(fd, VMODE, GRAPHICS_ON);
+  ioctl(fd, SYNC);
+  if(ioctl(fd, BIND_DMA, &ringAddr) < 0){
+    perror("BIND_DMA");
+    ioctl(fd, VMODE, GRAPHICS_OFF);
+    return -1;
+  }
+  if(ioctl(fd, BIND_RING, &ringAddr) < 0){
+    perror("BIND_RING");
+    ioctl(fd, VMODE, GRAPHICS_OFF);
+    return -1;
+  }
+  rings = (volatile struct k2_rings*)(unsigned long)ringAddr;
+  return 0;
+}
+
+
+//Post a buffer to the submission ring, ring the doorbell only if the card went idle
+int ringSubmit(int fd, unsigned int buffer, unsigned int length, unsigned int flags, unsigned int user_data){
+  volatile struct k2_sqe *sqe;
+  struct timespec ts;
+  unsigned int tail = rings->sq_tail;
+
+  //Ring full
+  if(tail - rings->sq_head >= RING_ENTRIES)
+    return -1;
+
+  sqe = &(rings->sq[tail & (RING_ENTRIES-1)]);
+  sqe->buffer = buffer;
+  sqe->length = length;
+  sqe->flags = flags;
+  sqe->user_data = user_data;
+  //Same clock as the driver's ktime_get, so queueing latency starts here
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  sqe->submit_ns = (__u64)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+
+  //Entry must be visible before the tail, and the tail before we look at idle
+  __sync_synchronize();
+  rings->sq_tail = tail + 1;
+  __sync_synchronize();
+
+  if(rings->idle)
+    ioctl(fd, RING_DOORBELL);
+  return 0;
+}
+
+
+//Take the next completion off the ring, returns 0 if there is none yet
+int ringReap(struct k2_cqe *cqe){
+  unsigned int head = rings->cq_head;
+
+  if(head == rings->cq_tail)
+    return 0;
+  __sync_synchronize();
+  cqe->seq = rings->cq[head & (RING_ENTRIES-1)].seq;
+  cqe->buffer = rings->cq[head & (RING_ENTRIES-1)].buffer;
+  cqe->result = rings->cq[head & (RING_ENTRIES-1)].result;
+  cqe->user_data = rings->cq[head & (RING_ENTRIES-1)].user_data;
+  __sync_synchronize();
+  rings->cq_head = head + 1;
+  return 1;
+}
+
+
+//Draw random triangles through the shared rings, no ioctl while the card is busy
+void ringTriangles(int fd, int count){
+  int freeList[NUM_BUFFER], nfree = NUM_BUFFER, k, errors = 0;
+  unsigned int buffsize = 19*sizeof(float);
+  struct k2_cqe cqe;
+
+  for(k = 0; k < NUM_BUFFER; ++k)
+    freeList[k] = k;
+
+  for(k = 0; k < count; ++k){
+    //Spin on completions until a buffer is free again
+    while(nfree == 0){
+      while(ringReap(&cqe)){
+        errors += cqe.result != 0;
+        freeList[nfree++] = cqe.buffer;
+      }
+    }
+    --nfree;
+    rand_tri((union buffer*)(unsigned long)rings->buffer_addr[freeList[nfree]]);
+    ringSubmit(fd, freeList[nfree], buffsize, 0, k);
+  }
+
+  //Wait for the rest to come back
+  while(nfree < NUM_BUFFER){
+    while(ringReap(&cqe)){
+      errors += cqe.result != 0;
+      ++nfree;
+    }
+  }
+  printf("Last completion seq %u, %d rejected\n", rings->seq, errors);
+}
+
+
+//Max triangles per draw command, the header count field holds 1023 vertices
+#define STREAM_CMD_TRIS 341
+//Words per triangle: 3 vertices of RGB + XYZ
+#define TRI_WORDS 18
+
+//USER Struct: a streaming draw. One DMA buffer is packed while the ones
+//already submitted through the rings are in flight.
+struct draw_stream{
+  int fd;
+  int freeList[NUM_BUFFER];
+  int nfree;
+  int cur;
+  union buffer *buf;
+  unsigned int pos;
+  unsigned int hdr;
+  unsigned int cmdTris;
+  unsigned long buffers;
+  unsigned long triangles;
+};
+
+
+//Header of a draw command carrying 'vertices' RGB + XYZ vertices
+union buffer triHeader(int vertices){
+  union buffer tri_header;
+  tri_header.header.stride=5;
+  tri_header.header.has_v4=0;
+  tri_header.header.has_c3=1;
+  tri_header.header.has_c4=0;
+  tri_header.header.unused=0;
+  tri_header.header.prim_type=1;
+  tri_header.header.count=vertices;
+  tri_header.header.opcode=0x14;
+  return tri_header;
+}
+
+
+//Put completed buffers back on the free list, spin until one is free if 'wait'
+void streamReap(struct draw_stream *st, int wait){
+  struct k2_cqe cqe;
+  do{
+    while(ringReap(&cqe))
+      st->freeList[st->nfree++] = cqe.buffer;
+  }while(wait && st->nfree == 0);
+}
+
+
+//Start a stream on a device whose DMA buffers and rings are bound
+void streamBegin(struct draw_stream *st, int fd){
+  int i;
+  st->fd = fd;
+  for(i = 0; i < NUM_BUFFER; ++i)
+    st->freeList[i] = i;
+  st->nfree = NUM_BUFFER;
+  st->cur = -1;
+  st->buffers = 0;
+  st->triangles = 0;
+}
+
+
+//Close the open draw command and submit the buffer being packed
+void streamFlush(struct draw_stream *st){
+  if(st->cur < 0)
+    return;
+  if(st->cmdTris)
+    st->buf[st->hdr] = triHeader(3*st->cmdTris);
+  ringSubmit(st->fd, st->cur, st->pos*sizeof(float), 0, st->buffers++);
+  st->cur = -1;
+}
+
+
+//Append 'ntri' triangles (TRI_WORDS floats each), splitting at triangle boundaries
+void streamDraw(struct draw_stream *st, const float *tris, unsigned long ntri){
+  unsigned int limit = SIZE_BUFFER*1024/sizeof(float), room, n;
+
+  while(ntri){
+    //Grab a free buffer, the card keeps draining the others meanwhile
+    if(st->cur < 0){
+      streamReap(st, 1);
+      st->cur = st->freeList[--st->nfree];
+      st->buf = (union buffer*)(unsigned long)rings->buffer_addr[st->cur];
+      st->pos = 0;
+      st->cmdTris = 0;
+    }
+
+    //Open a new command when there is none or the current one is full
+    if(st->cmdTris == 0 || st->cmdTris == STREAM_CMD_TRIS){
+      if(st->cmdTris)
+        st->buf[st->hdr] = triHeader(3*st->cmdTris);
+      if(st->pos + 1 + TRI_WORDS > limit){
+        streamFlush(st);
+        continue;
+      }
+      st->hdr = st->pos++;
+      st->cmdTris = 0;
+    }
+
+    //Copy as many whole triangles as fit in this command and buffer
+    room = (limit - st->pos) / TRI_WORDS;
+    n = STREAM_CMD_TRIS - st->cmdTris;
+    if(n > room)
+      n = room;
+    if(n > ntri)
+      n = ntri;
+    if(n == 0){
+      streamFlush(st);
+      continue;
+    }
+    memcpy(&st->buf[st->pos], tris, n*TRI_WORDS*sizeof(float));
+    st->pos += n*TRI_WORDS;
+    st->cmdTris += n;
+    tris += n*TRI_WORDS;
+    ntri -= n;
+    st->triangles += n;
+  }
+}
+
+
+//Submit what is left and wait until the card has drained every buffer
+void streamEnd(struct draw_stream *st){
+  streamFlush(st);
+  while(st->nfree < NUM_BUFFER)
+    streamReap(st, 1);
+}
+
+
+//Wall clock time in seconds
+double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+//Fill a whole DMA buffer with draw commands of 'tris' triangles each, returns bytes used
+unsigned int fillValidBuffer(union buffer *buff, int tris){
+  union buffer tri_header;
+  unsigned int pos = 0, limit = SIZE_BUFFER*1024/sizeof(float);
+  int i;
+
+  tri_header.header.stride=5;
+  tri_header.header.has_v4=0;
+  tri_header.header.has_c3=1;
+  tri_header.header.has_c4=0;
+  tri_header.header.unused=0;
+  tri_header.header.prim_type=1;
+  tri_header.header.count=3*tris;
+  tri_header.header.opcode=0x14;
+
+  while(pos + 1 + 18*tris <= limit){
+    buff[pos++].header=tri_header.header;
+    for(i = 0; i < 18*tris; ++i)
+      buff[pos++].memory=rand_float();
+  }
+  return pos*sizeof(float);
+}
+
+
+//Measure cost of validation per MB of command stream: the header walk on
+//its own, and together with the copy into the staging buffer the driver
+//makes before every check (that pair is what a submission really pays)
+void benchValidate(void){
+  union buffer *buff = malloc(SIZE_BUFFER*1024);
+  unsigned int *staging = malloc(SIZE_BUFFER*1024);
+  int sizes[2] = {1, 341};
+  int s, r, rounds = 20000, bad = 0;
+  unsigned int bytes;
+  double start, secs, mb;
+
+  for(s = 0; s < 2; ++s){
+    bytes = fillValidBuffer(buff, sizes[s]);
+    mb = (double)bytes*rounds/(1<<20);
+
+    start = now_sec();
+    for(r = 0; r < rounds; ++r)
+      bad += dma_check_stream((unsigned int*)buff, bytes) != DMA_CHECK_OK;
+    secs = now_sec() - start;
+    printf("%3d triangle(s)/command, check:        %8.1f MB/s, %8.2f us per MB, %d rejected\n",
+           sizes[s], mb/secs, secs*1e6/mb, bad);
+
+    start = now_sec();
+    for(r = 0; r < rounds; ++r){
+      memcpy(staging, buff, bytes);
+      bad += dma_check_stream(staging, bytes) != DMA_CHECK_OK;
+    }
+    secs = now_sec() - start;
+    printf("%3d triangle(s)/command, copy + check: %8.1f MB/s, %8.2f us per MB, %6.2f us per submission, %d rejected\n",
+           sizes[s], mb/secs, secs*1e6/mb, secs*1e6/rounds, bad);
+  }
+  free(staging);
+  free(buff);
+}
+
+
+//First CPU listed for a NUMA node in sysfs, -1 if the node does not exist
+int firstCpuOfNode(int node){
+  char path[64];
+  int cpu = -1;
+  FILE *f;
+
+  snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+  f = fopen(path, "r");
+  if(f == NULL)
+    return -1;
+  if(fscanf(f, "%d", &cpu) != 1)
+    cpu = -1;
+  fclose(f);
+  return cpu;
+}
+
+
+//Pin the calling thread to one CPU
+void pinToCpu(int cpu){
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  sched_setaffinity(0, sizeof(set), &set);
+}
+
+
+//Pack full DMA buffers from 'cpu' and push them through the rings. Reports
+//MB/s of the packing copies alone, which is where the node matters, and
+//MB/s end to end, which the card's DMA rate caps.
+void packFromCpu(int fd, int cpu, int rounds, double *packMBs, double *ringMBs){
+  int freeList[NUM_BUFFER], nfree = NUM_BUFFER, k;
+  union buffer *pattern;
+  unsigned int bytes;
+  struct k2_cqe cqe;
+  double start, secs, packStart, packSecs = 0;
+
+  pinToCpu(cpu);
+  //Source pattern is first touched after pinning so it is local to 'cpu'
+  pattern = malloc(SIZE_BUFFER*1024);
+  bytes = fillValidBuffer(pattern, 341);
+  for(k = 0; k < NUM_BUFFER; ++k)
+    freeList[k] = k;
+
+  start = now_sec();
+  for(k = 0; k < rounds; ++k){
+    while(nfree == 0)
+      while(ringReap(&cqe))
+        freeList[nfree++] = cqe.buffer;
+    --nfree;
+    packStart = now_sec();
+    memcpy((void*)(unsigned long)rings->buffer_addr[freeList[nfree]], pattern, bytes);
+    packSecs += now_sec() - packStart;
+    ringSubmit(fd, freeList[nfree], bytes, 0, k);
+  }
+  while(nfree < NUM_BUFFER)
+    while(ringReap(&cqe))
+      ++nfree;
+  secs = now_sec() - start;
+
+  free(pattern);
+  *packMBs = (double)bytes*rounds/(1<<20)/packSecs;
+  *ringMBs = (double)bytes*rounds/(1<<20)/secs;
+}
+
+
+//Compare submitting from the card's NUMA node against a remote node
+void benchNuma(int fd){
+  struct k2_node_info info;
+  int node, remote = -1, localCpu, remoteCpu = -1;
+  double pack, ring;
+
+  if(ringSetup(fd))
+    return;
+  if(ioctl(fd, GET_NODE, &info) < 0){
+    printf("GET_NODE failed\n");
+    ioctl(fd, VMODE, GRAPHICS_OFF);
+    return;
+  }
+  printf("Card on node %d, %u DMA buffers off node\n", info.node, info.remote_buffers);
+
+  node = info.node < 0 ? 0 : info.node;
+  localCpu = firstCpuOfNode(node);
+  if(localCpu < 0)
+    localCpu = 0;
+  for(remote = 0; remote < 64 && remoteCpu < 0; ++remote)
+    if(remote != node)
+      remoteCpu = firstCpuOfNode(remote);
+
+  packFromCpu(fd, localCpu, 2000, &pack, &ring);
+  printf("local  (cpu %d): packing %8.1f MB/s, ring submission %8.1f MB/s\n", localCpu, pack, ring);
+  if(remoteCpu < 0)
+    printf("remote: single node host, nothing to compare\n");
+  else {
+    packFromCpu(fd, remoteCpu, 2000, &pack, &ring);
+    printf("remote (cpu %d): packing %8.1f MB/s, ring submission %8.1f MB/s\n", remoteCpu, pack, ring);
+  }
+
+  ioctl(fd, VMODE, GRAPHICS_OFF);
+}
+
+
+//Edge of the screen tiles dirty tracking works on, in pixels
+#define BLIT_TILE 64
+
+//USER Struct: 2D upload engine. The caller marks the rectangles it changed
+//each frame and only tiles under those marks are sent to the card. With
+//'compare' set, marked tiles are also checked byte for byte against a copy
+//of what was last uploaded and skipped when nothing really changed.
+struct blitter{
+  unsigned int width;
+  unsigned int height;
+  unsigned int pitch;
+  unsigned int tilesX;
+  unsigned int tilesY;
+  unsigned char *dirty;
+  //Per tile: shadow holds what the card shows there
+  unsigned char *shadowValid;
+  unsigned int *shadow;
+  int compare;
+  unsigned long bytes;
+  unsigned long copied;
+  unsigned long skipped;
+}blit;
+
+
+//Set up for the VMODE GRAPHICS_ON video mode, 'compare' keeps a shadow copy
+//of the screen for content checks. Returns -1 if out of memory.
+int blitInit(int compare){
+  blit.width = FRAME_WIDTH;
+  blit.height = FRAME_HEIGHT;
+  blit.pitch = FRAME_PITCH;
+  blit.tilesX = (blit.width + BLIT_TILE - 1) / BLIT_TILE;
+  blit.tilesY = (blit.height + BLIT_TILE - 1) / BLIT_TILE;
+  blit.dirty = malloc(blit.tilesX*blit.tilesY);
+  blit.shadowValid = malloc(blit.tilesX*blit.tilesY);
+  blit.compare = compare;
+  blit.shadow = compare ? malloc(4*blit.width*blit.height) : NULL;
+  blit.bytes = blit.copied = blit.skipped = 0;
+  if(!blit.dirty || !blit.shadowValid || (compare && !blit.shadow))
+    return -1;
+  //Nothing is known about what the card shows yet
+  memset(blit.dirty, 1, blit.tilesX*blit.tilesY);
+  memset(blit.shadowValid, 0, blit.tilesX*blit.tilesY);
+  return 0;
+}
+
+
+//Release the dirty marks and the shadow copy
+void blitFree(void){
+  free(blit.dirty);
+  free(blit.shadowValid);
+  free(blit.shadow);
+}
+
+
+//Mark a screen rectangle as changed since the last blitEndFrame
+void blitMarkDirty(int x, int y, int w, int h){
+  int tx, ty;
+
+  //Clip to the screen
+  if(x < 0){ w += x; x = 0; }
+  if(y < 0){ h += y; y = 0; }
+  if(x + w > (int)blit.width) w = blit.width - x;
+  if(y + h > (int)blit.height) h = blit.height - y;
+  if(w <= 0 || h <= 0)
+    return;
+
+  for(ty = y / BLIT_TILE; ty * BLIT_TILE < y + h; ++ty)
+    for(tx = x / BLIT_TILE; tx * BLIT_TILE < x + w; ++tx)
+      blit.dirty[ty*blit.tilesX + tx] = 1;
+}
+
+
+//Mark the whole screen, needed after anything else draws to the framebuffer
+void blitInvalidate(void){
+  memset(blit.dirty, 1, blit.tilesX*blit.tilesY);
+  memset(blit.shadowValid, 0, blit.tilesX*blit.tilesY);
+}
+
+
+//Frame is uploaded: forget this frame's marks
+void blitEndFrame(void){
+  memset(blit.dirty, 0, blit.tilesX*blit.tilesY);
+}
+
+
+//Size of a tile, smaller along the right and bottom edges of the screen
+int blitTileW(int tx){
+  return (tx+1)*BLIT_TILE <= (int)blit.width ? BLIT_TILE : (int)blit.width - tx*BLIT_TILE;
+}
+
+int blitTileH(int ty){
+  return (ty+1)*BLIT_TILE <= (int)blit.height ? BLIT_TILE : (int)blit.height - ty*BLIT_TILE;
+}
+
+
+//Whether a tile part already holds these pixels, per the shadow copy
+int blitSame(const unsigned int *src, unsigned int srcPitch, int x, int y, int w, int h){
+  int j;
+
+  for(j = 0; j < h; ++j)
+    if(memcmp(blit.shadow + (y+j)*blit.width + x, src + j*srcPitch, 4*w))
+      return 0;
+  return 1;
+}
+
+
+//Copy one row into card RAM with non-temporal 16 byte stores where aligned
+void blitRow(unsigned int *dst, const unsigned int *src, int pixels){
+  int i = 0;
+#ifdef __SSE2__
+  for(; i < pixels && ((unsigned long)(dst + i) & 15); ++i)
+    dst[i] = src[i];
+  for(; i + 4 <= pixels; i += 4)
+    _mm_stream_si128((__m128i*)(dst + i), _mm_loadu_si128((const __m128i*)(src + i)));
+#endif
+  for(; i < pixels; ++i)
+    dst[i] = src[i];
+}
+
+
+//Upload a w x h image ('srcPitch' pixels per row) to (x, y). Only tiles
+//marked dirty are copied, and with 'compare' only those whose pixels differ.
+void blitRect(const unsigned int *src, unsigned int srcPitch, int x, int y, int w, int h){
+  int tx, ty, x0, y0, x1, y1, j;
+  const unsigned int *part;
+
+  //Clip to the screen
+  if(x < 0){ src -= x; w += x; x = 0; }
+  if(y < 0){ src -= y*(int)srcPitch; h += y; y = 0; }
+  if(x + w > (int)blit.width) w = blit.width - x;
+  if(y + h > (int)blit.height) h = blit.height - y;
+  if(w <= 0 || h <= 0)
+    return;
+
+  for(ty = y / BLIT_TILE; ty * BLIT_TILE < y + h; ++ty){
+    for(tx = x / BLIT_TILE; tx * BLIT_TILE < x + w; ++tx){
+      if(!blit.dirty[ty*blit.tilesX + tx]){
+        blit.skipped++;
+        continue;
+      }
+
+      //Part of the rectangle that falls in this tile
+      x0 = tx*BLIT_TILE > x ? tx*BLIT_TILE : x;
+      y0 = ty*BLIT_TILE > y ? ty*BLIT_TILE : y;
+      x1 = (tx+1)*BLIT_TILE < x + w ? (tx+1)*BLIT_TILE : x + w;
+      y1 = (ty+1)*BLIT_TILE < y + h ? (ty+1)*BLIT_TILE : y + h;
+      part = src + (y0-y)*srcPitch + (x0-x);
+
+      if(blit.compare){
+        if(blit.shadowValid[ty*blit.tilesX + tx] && blitSame(part, srcPitch, x0, y0, x1-x0, y1-y0)){
+          blit.skipped++;
+          continue;
+        }
+        for(j = 0; j < y1-y0; ++j)
+          memcpy(blit.shadow + (y0+j)*blit.width + x0, part + j*srcPitch, 4*(x1-x0));
+        //Shadow only speaks for the tile once all of it went through here
+        if(x1-x0 == blitTileW(tx) && y1-y0 == blitTileH(ty))
+          blit.shadowValid[ty*blit.tilesX + tx] = 1;
+      }
+
+      for(j = y0; j < y1; ++j)
+        blitRow(k2.u_fb_base + j*(blit.pitch/4) + x0, src + (j-y)*srcPitch + (x0-x), x1-x0);
+      blit.copied++;
+      blit.bytes += 4*(x1-x0)*(y1-y0);
+    }
+  }
+#ifdef __SSE2__
+  //Drain write-combining buffers before anyone else looks at the frame
+  _mm_sfence();
+#endif
+}
+
+
+//Upload throughput and per-frame cost, full frames and mostly static frames
+void benchBlit(int fd){
+  unsigned int *image;
+  int frames = 200, f, i;
+  double start, secs;
+
+  k2.u_control_base = mmap(0, KYOUKO2_CONTROL_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if((long)k2.u_control_base == -1)
+    return;
+  k2.u_fb_base = mmap(0, U_READ_REG(Device_RAM)*1024*1024, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0x80000000);
+  ioctl(fd, VMODE, GRAPHICS_ON);
+  ioctl(fd, SYNC);
+  if(blitInit(0)){
+    printf("Out of memory\n");
+    return;
+  }
+
+  image = malloc(4*blit.width*blit.height);
+  for(i = 0; i < (int)(blit.width*blit.height); ++i)
+    image[i] = rand();
+
+  //Every tile changes: raw upload bandwidth
+  start = now_sec();
+  for(f = 0; f < frames; ++f){
+    blitInvalidate();
+    blitRect(image, blit.width, 0, 0, blit.width, blit.height);
+    blitEndFrame();
+  }
+  secs = now_sec() - start;
+  printf("full frames:   %8.1f MB/s, %6.2f ms/frame\n", blit.bytes/secs/(1<<20), secs*1e3/frames);
+
+  //A HUD-like frame: one 128x128 patch is marked, the rest is skipped
+  blit.bytes = blit.copied = blit.skipped = 0;
+  start = now_sec();
+  for(f = 0; f < frames; ++f){
+    image[(f % 128)*blit.width + f % 128] ^= 0xffffff;
+    blitMarkDirty(0, 0, 128, 128);
+    blitRect(image, blit.width, 0, 0, blit.width, blit.height);
+    blitEndFrame();
+  }
+  secs = now_sec() - start;
+  printf("mostly static: %8.1f MB/s, %6.2f ms/frame, %lu tiles copied, %lu skipped\n",
+         blit.bytes/secs/(1<<20), secs*1e3/frames, blit.copied, blit.skipped);
+  blitFree();
+
+  //Same frames, but the caller marks the whole screen and the content
+  //compare against the shadow copy finds the changed patch
+  if(blitInit(1)){
+    printf("Out of memory\n");
+    free(image);
+    return;
+  }
+  start = now_sec();
+  for(f = 0; f < frames; ++f){
+    image[(f % 128)*blit.width + f % 128] ^= 0xffffff;
+    blitMarkDirty(0, 0, blit.width, blit.height);
+    blitRect(image, blit.width, 0, 0, blit.width, blit.height);
+    blitEndFrame();
+  }
+  secs = now_sec() - start;
+  printf("compare:       %8.1f MB/s, %6.2f ms/frame, %lu tiles copied, %lu skipped\n",
+         blit.bytes/secs/(1<<20), secs*1e3/frames, blit.copied, blit.skipped);
+
+  free(image);
+  blitFree();
+  sleep(2);
+  ioctl(fd, VMODE, GRAPHICS_OFF);
+}
+
+
+//Snapshots that may wait for the writer before frames are dropped
+#define CAPTURE_SLOTS 8
+//Frames handed to the kernel per writev
+#define CAPTURE_BATCH 4
+
+//USER Struct: frame capture. The render loop only snapshots the framebuffer
+//into a free slot; conversion and disk I/O happen on the writer thread.
+struct frame_capture{
+  unsigned int width;
+  unsigned int height;
+  unsigned int pitch;
+  unsigned int *slot[CAPTURE_SLOTS];
+  unsigned char *rgb[CAPTURE_BATCH];
+  char ppmHeader[32];
+  int ppmHeaderLen;
+  volatile unsigned long head;
+  volatile unsigned long tail;
+  unsigned long dropped;
+  //Frames on disk, and frames lost to write errors
+  unsigned long written;
+  unsigned long failed;
+  int streamLoads;
+  //Time the render loop spent taking snapshots
+  double snapSecs;
+  volatile int stop;
+  int out;
+  pthread_t writer;
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+}cap;
+
+
+#ifdef __SSE2__
+//Row copy with streaming loads, which read write-combined framebuffer
+//lines whole. Built for SSE4.1 only, captureStart checks the CPU has it.
+__attribute__((target("sse4.1")))
+void copyRowStream(unsigned int *dst, const unsigned int *src, unsigned int pixels){
+  unsigned int i = 0;
+  for(; i + 4 <= pixels; i += 4)
+    _mm_store_si128((__m128i*)(dst + i), _mm_stream_load_si128((__m128i*)(src + i)));
+  for(; i < pixels; ++i)
+    dst[i] = src[i];
+}
+#endif
+
+
+//Copy one framebuffer row with 16 byte loads, streaming loads if the CPU has them
+void copyRow(unsigned int *dst, const unsigned int *src, unsigned int pixels){
+  unsigned int i = 0;
+#ifdef __SSE2__
+  if(cap.streamLoads){
+    copyRowStream(dst, src, pixels);
+    return;
+  }
+  for(; i + 4 <= pixels; i += 4)
+    _mm_store_si128((__m128i*)(dst + i), _mm_load_si128((const __m128i*)(src + i)));
+#endif
+  for(; i < pixels; ++i)
+    dst[i] = src[i];
+}
+
+
+//Convert a row of 0xF888 (x8r8g8b8) pixels to packed 24 bit RGB.
+//The SIMD path stores 16 bytes per 4 pixels, so 'dst' needs 4 bytes of slack.
+void convertRow(unsigned char *dst, const unsigned int *src, unsigned int pixels){
+  unsigned int i = 0;
+#ifdef __SSSE3__
+  const __m128i mask = _mm_setr_epi8(2,1,0, 6,5,4, 10,9,8, 14,13,12, -1,-1,-1,-1);
+  for(; i + 4 <= pixels; i += 4)
+    _mm_storeu_si128((__m128i*)(dst + 3*i), _mm_shuffle_epi8(_mm_load_si128((const __m128i*)(src + i)), mask));
+#endif
+  for(; i < pixels; ++i){
+    dst[3*i] = src[i] >> 16;
+    dst[3*i+1] = src[i] >> 8;
+    dst[3*i+2] = src[i];
+  }
+}
+
+
+//Write all of 'iov', carrying on after short writes. Returns -1 on error.
+int writeAll(int fd, struct iovec *iov, int cnt){
+  ssize_t n;
+
+  while(cnt > 0){
+    n = writev(fd, iov, cnt);
+    if(n < 0 && errno == EINTR)
+      continue;
+    if(n <= 0)
+      return -1;
+    //Skip what went out, trim the vector it stopped in
+    while(cnt > 0 && (size_t)n >= iov->iov_len){
+      n -= iov->iov_len;
+      ++iov;
+      --cnt;
+    }
+    if(cnt > 0){
+      iov->iov_base = (char*)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return 0;
+}
+
+
+//Writer thread: convert queued snapshots and write them out in batches
+void *captureWriter(void *unused){
+  struct iovec iov[2*CAPTURE_BATCH];
+  unsigned long n, i, y;
+  unsigned int *frame;
+
+  for(;;){
+    pthread_mutex_lock(&cap.lock);
+    while(cap.head == cap.tail && !cap.stop)
+      pthread_cond_wait(&cap.ready, &cap.lock);
+    pthread_mutex_unlock(&cap.lock);
+    if(cap.head == cap.tail)
+      break;
+
+    n = cap.head - cap.tail;
+    if(n > CAPTURE_BATCH)
+      n = CAPTURE_BATCH;
+    for(i = 0; i < n; ++i){
+      frame = cap.slot[(cap.tail + i) % CAPTURE_SLOTS];
+      for(y = 0; y < cap.height; ++y)
+        convertRow(cap.rgb[i] + 3*cap.width*y, frame + cap.width*y, cap.width);
+      iov[2*i].iov_base = cap.ppmHeader;
+      iov[2*i].iov_len = cap.ppmHeaderLen;
+      iov[2*i+1].iov_base = cap.rgb[i];
+      iov[2*i+1].iov_len = 3*cap.width*cap.height;
+    }
+    //After a failed write the stream is cut mid frame, later frames are lost too
+    if(cap.failed || writeAll(cap.out, iov, 2*n)){
+      if(!cap.failed)
+        perror("capture write");
+      cap.failed += n;
+    }
+    else
+      cap.written += n;
+
+    //Slots are free again once their frames are on their way to disk
+    __sync_synchronize();
+    cap.tail += n;
+  }
+  return NULL;
+}
+
+
+//Start capturing the current video mode into 'path' as concatenated PPM frames
+int captureStart(const char *path){
+  int i;
+
+  //Mode VMODE GRAPHICS_ON sets; no register reads over the bus
+  cap.width = FRAME_WIDTH;
+  cap.height = FRAME_HEIGHT;
+  cap.pitch = FRAME_PITCH;
+  cap.ppmHeaderLen = snprintf(cap.ppmHeader, sizeof(cap.ppmHeader), "P6\n%u %u\n255\n", cap.width, cap.height);
+  cap.head = cap.tail = cap.dropped = 0;
+  cap.written = cap.failed = 0;
+#ifdef __SSE2__
+  cap.streamLoads = __builtin_cpu_supports("sse4.1");
+#endif
+  cap.snapSecs = 0;
+  cap.stop = 0;
+
+  cap.out = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  if(cap.out < 0)
+    return -1;
+  for(i = 0; i < CAPTURE_SLOTS; ++i)
+    if(posix_memalign((void**)&cap.slot[i], 64, 4*cap.width*cap.height))
+      return -1;
+  for(i = 0; i < CAPTURE_BATCH; ++i)
+    if(posix_memalign((void**)&cap.rgb[i], 64, 3*cap.width*cap.height + 16))
+      return -1;
+
+  pthread_mutex_init(&cap.lock, NULL);
+  pthread_cond_init(&cap.ready, NULL);
+  return pthread_create(&cap.writer, NULL, captureWriter, NULL);
+}
+
+
+//Snapshot the framebuffer from the render loop, never waits on the writer
+void captureFrame(void){
+  unsigned int *frame, y;
+  double start;
+
+  //Back-pressure: writer is behind, drop this frame instead of stalling
+  if(cap.head - cap.tail >= CAPTURE_SLOTS){
+    cap.dropped++;
+    return;
+  }
+
+  start = now_sec();
+  frame = cap.slot[cap.head % CAPTURE_SLOTS];
+  for(y = 0; y < cap.height; ++y)
+    copyRow(frame + cap.width*y, k2.u_fb_base + (cap.pitch/4)*y, cap.width);
+  cap.snapSecs += now_sec() - start;
+
+  //Publish the snapshot, then wake the writer
+  __sync_synchronize();
+  pthread_mutex_lock(&cap.lock);
+  cap.head++;
+  pthread_cond_signal(&cap.ready);
+  pthread_mutex_unlock(&cap.lock);
+}
+
+
+//Flush queued frames, stop the writer and release the ring
+void captureStop(void){
+  int i;
+
+  pthread_mutex_lock(&cap.lock);
+  cap.stop = 1;
+  pthread_cond_signal(&cap.ready);
+  pthread_mutex_unlock(&cap.lock);
+  pthread_join(cap.writer, NULL);
+
+  close(cap.out);
+  for(i = 0; i < CAPTURE_SLOTS; ++i)
+    free(cap.slot[i]);
+  for(i = 0; i < CAPTURE_BATCH; ++i)
+    free(cap.rgb[i]);
+}
+
+
+//Render random triangles each frame and capture them to disk
+void captureDemo(int fd, int frames){
+  struct draw_stream st;
+  float tris[64*TRI_WORDS];
+  double start, secs;
+  int f, i;
+
+  //Capture reads the framebuffer directly, so map it like the FIFO case
+  k2.u_control_base = mmap(0, KYOUKO2_CONTROL_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if((long)k2.u_control_base == -1)
+    return;
+  k2.u_fb_base = mmap(0, U_READ_REG(Device_RAM)*1024*1024, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0x80000000);
+
+  if(ringSetup(fd))
+    return;
+
+  if(captureStart("capture.ppm")){
+    printf("Could not start capture\n");
+    return;
+  }
+
+  start = now_sec();
+  for(f = 0; f < frames; ++f){
+    for(i = 0; i < 64*TRI_WORDS; ++i)
+      tris[i] = rand_range(-1, 0.5);
+    streamBegin(&st, fd);
+    streamDraw(&st, tris, 64);
+    streamEnd(&st);
+    ioctl(fd, FLUSH);
+    ioctl(fd, SYNC);
+    captureFrame();
+  }
+  secs = now_sec() - start;
+  captureStop();
+
+  printf("%d frames in %.2f s (%.1f fps), %lu written, %lu dropped, %lu failed\n",
+         frames, secs, frames/secs, cap.written, cap.dropped, cap.failed);
+  //Cost the render thread pays per frame for the snapshot
+  if(cap.head)
+    printf("snapshot: %.3f ms/frame (%u KB each)\n",
+           cap.snapSecs*1e3/cap.head, 4*cap.width*cap.height/1024);
+  ioctl(fd, VMODE, GRAPHICS_OFF);
+}
+
+
+//Print a latency histogram class from GET_LAT_HIST
+void printLatHist(const char *name, unsigned int *bucket){
+  int i;
+  printf("%s:\n", name);
+  for(i = 0; i < LAT_BUCKETS; ++i)
+    if(bucket[i])
+      printf("  < %8u us: %u\n", 1u << i, bucket[i]);
+}
+
+
+//Urgent one-triangle submissions mixed into full bulk buffers
+void benchPriority(int fd){
+  int freeList[NUM_BUFFER-1], nfree = NUM_BUFFER-1, k, urgentBusy = 0;
+  unsigned int bulkBytes, urgentBytes = 19*sizeof(float);
+  union buffer *pattern;
+  struct k2_lat_hist hist;
+  struct k2_cqe cqe;
+  //Last buffer is kept for urgent work, the rest carry bulk traffic
+  unsigned int urgentBuf = NUM_BUFFER-1;
+
+  if(ringSetup(fd))
+    return;
+
+  pattern = malloc(SIZE_BUFFER*1024);
+  bulkBytes = fillValidBuffer(pattern, 341);
+  for(k = 0; k < NUM_BUFFER-1; ++k)
+    freeList[k] = k;
+  rand_tri((union buffer*)(unsigned long)rings->buffer_addr[urgentBuf]);
+
+  for(k = 0; k < 2000; ++k){
+    //Reap, spinning until a bulk buffer is free
+    do{
+      while(ringReap(&cqe)){
+        if(cqe.buffer == urgentBuf)
+          urgentBusy = 0;
+        else
+          freeList[nfree++] = cqe.buffer;
+      }
+    }while(nfree == 0);
+
+    --nfree;
+    memcpy((void*)(unsigned long)rings->buffer_addr[freeList[nfree]], pattern, bulkBytes);
+    ringSubmit(fd, freeList[nfree], bulkBytes, 0, k);
+
+    //Every 8th bulk buffer, slip in an urgent triangle if the last one is back
+    if(k % 8 == 0 && !urgentBusy){
+      urgentBusy = 1;
+      ringSubmit(fd, urgentBuf, urgentBytes, K2_SQE_URGENT, k);
+    }
+  }
+  while(nfree < NUM_BUFFER-1 || urgentBusy)
+    while(ringReap(&cqe)){
+      if(cqe.buffer == urgentBuf)
+        urgentBusy = 0;
+      else
+        ++nfree;
+    }
+
+  if(ioctl(fd, GET_LAT_HIST, &hist) == 0){
+    printLatHist("urgent", hist.bucket[K2_CLASS_URGENT]);
+    printLatHist("bulk", hist.bucket[K2_CLASS_BULK]);
+  }
+  free(pattern);
+  ioctl(fd, VMODE, GRAPHICS_OFF);
+}
+
+
+//Round trip latency of RING_WAIT with interrupt and busy-poll completions
+void benchPoll(int fd){
+  unsigned int budgets[2] = {0, 200};
+  int depths[4] = {1, 2, 4, 8}, m, d, r, k, rounds = 500;
+  struct k2_cqe cqe;
+  double start, secs;
+
+  if(ringSetup(fd))
+    return;
+  for(k = 0; k < NUM_BUFFER; ++k)
+    rand_tri((union buffer*)(unsigned long)rings->buffer_addr[k]);
+
+  printf("mode         depth   us/round   us/buffer\n");
+  for(m = 0; m < 2; ++m){
+    ioctl(fd, SET_POLL, budgets[m]);
+    for(d = 0; d < 4; ++d){
+      start = now_sec();
+      for(r = 0; r < rounds; ++r){
+        for(k = 0; k < depths[d]; ++k)
+          ringSubmit(fd, k, 19*sizeof(float), 0, r);
+        ioctl(fd, RING_WAIT, depths[d]);
+        while(ringReap(&cqe));
+      }
+      secs = now_sec() - start;
+      printf("%-12s %5d %10.1f %11.1f\n", budgets[m] ? "poll 200us" : "interrupt",
+             depths[d], secs*1e6/rounds, secs*1e6/rounds/depths[d]);
+    }
+  }
+  ioctl(fd, SET_POLL, 0);
+  ioctl(fd, VMODE, GRAPHICS_OFF);
+}
+
+
+//USER Struct: one copy of the mesh, 4x4 row-major transform and RGB tint
+struct instance{
+  float transform[16];
+  float color[3];
+  //Transform and color unchanged since the last frame
+  int isStatic;
+};
+
+//USER Struct: a mesh drawn many times. Expanded instances are cached in
+//DMA vertex layout (RGB + XYZ) so static ones are not transformed again.
+struct instancer{
+  int meshVerts;
+  float *meshPos;
+  float *meshCol;
+  int count;
+  float *cache;
+  unsigned char *valid;
+  int threads;
+  const struct instance *inst;
+};
+
+//USER Struct: range of instances one expansion thread works on
+struct expand_job{
+  struct instancer *in;
+  int first;
+  int last;
+  int expanded;
+};
+
+
+//Set up an instancer for a mesh of 'tris' triangles given in DMA layout (TRI_WORDS floats each)
+int instancerInit(struct instancer *in, const float *mesh, int tris){
+  int v;
+
+  in->meshVerts = 3*tris;
+  //x y z 1 and r g b 0 per vertex, 16 byte aligned for SIMD loads
+  if(posix_memalign((void**)&in->meshPos, 16, 4*sizeof(float)*in->meshVerts) ||
+     posix_memalign((void**)&in->meshCol, 16, 4*sizeof(float)*in->meshVerts))
+    return -1;
+  for(v = 0; v < in->meshVerts; ++v){
+    in->meshCol[4*v] = mesh[6*v];
+    in->meshCol[4*v+1] = mesh[6*v+1];
+    in->meshCol[4*v+2] = mesh[6*v+2];
+    in->meshCol[4*v+3] = 0.0;
+    in->meshPos[4*v] = mesh[6*v+3];
+    in->meshPos[4*v+1] = mesh[6*v+4];
+    in->meshPos[4*v+2] = mesh[6*v+5];
+    in->meshPos[4*v+3] = 1.0;
+  }
+  in->count = 0;
+  in->cache = NULL;
+  in->valid = NULL;
+  in->threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if(in->threads < 1)
+    in->threads = 1;
+  return 0;
+}
+
+
+//Transform the mesh by one instance into 'dst' (6 floats per vertex)
+void expandInstance(const struct instancer *in, const struct instance *inst, float *dst){
+  const float *m = inst->transform;
+  int v;
+#ifdef __SSE2__
+  //Columns of the transform, so pos = c0*x + c1*y + c2*z + c3
+  __m128 c0 = _mm_setr_ps(m[0], m[4], m[8], m[12]);
+  __m128 c1 = _mm_setr_ps(m[1], m[5], m[9], m[13]);
+  __m128 c2 = _mm_setr_ps(m[2], m[6], m[10], m[14]);
+  __m128 c3 = _mm_setr_ps(m[3], m[7], m[11], m[15]);
+  __m128 tint = _mm_setr_ps(inst->color[0], inst->color[1], inst->color[2], 0.0);
+  __m128 p, c, t;
+
+  for(v = 0; v < in->meshVerts; ++v, dst += 6){
+    p = _mm_load_ps(in->meshPos + 4*v);
+    p = _mm_add_ps(_mm_add_ps(_mm_mul_ps(c0, _mm_shuffle_ps(p, p, _MM_SHUFFLE(0,0,0,0))),
+                              _mm_mul_ps(c1, _mm_shuffle_ps(p, p, _MM_SHUFFLE(1,1,1,1)))),
+                   _mm_add_ps(_mm_mul_ps(c2, _mm_shuffle_ps(p, p, _MM_SHUFFLE(2,2,2,2))), c3));
+    c = _mm_mul_ps(_mm_load_ps(in->meshCol + 4*v), tint);
+    //Words 0-3 get r g b -, then words 2-5 get b x y z; nothing past the vertex is touched
+    t = _mm_shuffle_ps(c, p, _MM_SHUFFLE(0,0,2,2));
+    _mm_storeu_ps(dst, c);
+    _mm_storeu_ps(dst + 2, _mm_shuffle_ps(t, p, _MM_SHUFFLE(2,1,2,0)));
+  }
+#else
+  const float *p, *c;
+  for(v = 0; v < in->meshVerts; ++v, dst += 6){
+    p = in->meshPos + 4*v;
+    c = in->meshCol + 4*v;
+    dst[0] = c[0]*inst->color[0];
+    dst[1] = c[1]*inst->color[1];
+    dst[2] = c[2]*inst->color[2];
+    dst[3] = m[0]*p[0] + m[1]*p[1] + m[2]*p[2] + m[3];
+    dst[4] = m[4]*p[0] + m[5]*p[1] + m[6]*p[2] + m[7];
+    dst[5] = m[8]*p[0] + m[9]*p[1] + m[10]*p[2] + m[11];
+  }
+#endif
+}
+
+
+//Thread body: expand the instances in a range whose cache entry is stale
+void *expandRange(void *arg){
+  struct expand_job *job = arg;
+  struct instancer *in = job->in;
+  int i, words = 6*in->meshVerts;
+
+  job->expanded = 0;
+  for(i = job->first; i < job->last; ++i){
+    if(in->valid[i] && in->inst[i].isStatic)
+      continue;
+    expandInstance(in, &in->inst[i], in->cache + (size_t)i*words);
+    in->valid[i] = 1;
+    job->expanded++;
+  }
+  return NULL;
+}
+
+
+//Expand 'count' instances across all cores and stream them to the card, returns instances transformed
+int instancerDraw(struct instancer *in, const struct instance *inst, int count, struct draw_stream *st){
+  pthread_t tid[64];
+  struct expand_job job[64];
+  int started[64];
+  int t, threads = in->threads > 64 ? 64 : in->threads, expanded = 0;
+
+  //Instance count changed, cache starts over
+  if(count != in->count){
+    free(in->cache);
+    free(in->valid);
+    in->cache = malloc((size_t)count*6*in->meshVerts*sizeof(float));
+    in->valid = calloc(count, 1);
+    if(in->cache == NULL || in->valid == NULL){
+      //Leave no half-built cache behind for the next call to trust
+      free(in->cache);
+      free(in->valid);
+      in->cache = NULL;
+      in->valid = NULL;
+      in->count = 0;
+      return -1;
+    }
+    in->count = count;
+  }
+  in->inst = inst;
+
+  if(threads > count)
+    threads = count > 0 ? count : 1;
+  for(t = 0; t < threads; ++t){
+    job[t].in = in;
+    job[t].first = (long)count*t/threads;
+    job[t].last = (long)count*(t+1)/threads;
+    started[t] = t > 0 && pthread_create(&tid[t], NULL, expandRange, &job[t]) == 0;
+  }
+  //This thread takes the first range, and any range a thread could not be started for
+  for(t = 0; t < threads; ++t)
+    if(!started[t])
+      expandRange(&job[t]);
+  for(t = 0; t < threads; ++t){
+    if(started[t])
+      pthread_join(tid[t], NULL);
+    expanded += job[t].expanded;
+  }
+
+  //Cache is in DMA layout already, the stream only adds headers
+  streamDraw(st, in->cache, (unsigned long)count*in->meshVerts/3);
+  return expanded;
+}
+
+
+//Many translated copies of one triangle, a tenth of them moving each frame
+void benchInstances(int fd){
+  struct instancer in;
+  struct instance *inst;
+  struct draw_stream st;
+  float mesh[TRI_WORDS];
+  int count, frames = 20, f, i, j, expanded;
+  double start, secs;
+
+  printf("Instances per frame (e.g. 100000):");
+  if(scanf("%d", &count) != 1 || count <= 0)
+    return;
+  if(ringSetup(fd))
+    return;
+
+  //Mesh is the first equilateral triangle from drawTriangles
+  for(i = 0; i < 3; ++i)
+    for(j = 0; j < 3; ++j){
+      mesh[6*i+j] = color[i][j];
+      mesh[6*i+3+j] = position[0][i][j];
+    }
+  if(instancerInit(&in, mesh, 1)){
+    ioctl(fd, VMODE, GRAPHICS_OFF);
+    return;
+  }
+
+  inst = calloc(count, sizeof(struct instance));
+  for(i = 0; i < count; ++i){
+    inst[i].transform[0] = inst[i].transform[5] = inst[i].transform[10] = inst[i].transform[15] = 0.1;
+    inst[i].transform[3] = rand_range(-1, 0.5);
+    inst[i].transform[7] = rand_range(-1, 0.5);
+    inst[i].color[0] = inst[i].color[1] = inst[i].color[2] = 1.0;
+  }
+
+  for(f = 0; f < frames; ++f){
+    for(i = 0; i < count; ++i){
+      inst[i].isStatic = f > 0 && i % 10 != f % 10;
+      if(!inst[i].isStatic)
+        inst[i].transform[7] += 0.001;
+    }
+    start = now_sec();
+    streamBegin(&st, fd);
+    expanded = instancerDraw(&in, inst, count, &st);
+    streamEnd(&st);
+    secs = now_sec() - start;
+    if(f < 2 || f == frames - 1)
+      printf("frame %2d: %7d transformed, %7.2f ms, %6.2f Minst/s, %lu buffers\n",
+             f, expanded, secs*1e3, count/secs/1e6, st.buffers);
+  }
+
+  free(inst);
+  free(in.cache);
+  free(in.valid);
+  free(in.meshPos);
+  free(in.meshCol);
+  ioctl(fd, VMODE, GRAPHICS_OFF);
+}
+
+
+//Sustained streaming throughput for growing input sizes
+void benchStream(int fd){
+  struct draw_stream st;
+  unsigned long n, done, chunk = 4096, maxTris;
+  float *tris;
+  double start, secs;
+  unsigned long i;
+
+  printf("Largest input in triangles (e.g. 1000000000):");
+  if(scanf("%lu", &maxTris) != 1)
+    return;
+
+  if(ringSetup(fd))
+    return;
+
+  //One chunk of random triangles, replayed to build inputs of any size
+  tris = malloc(chunk*TRI_WORDS*sizeof(float));
+  for(i = 0; i < chunk*TRI_WORDS; ++i)
+    tris[i] = rand_range(-1, 0.5);
+
+  for(n = 1000; n <= maxTris; n *= 10){
+    streamBegin(&st, fd);
+    start = now_sec();
+    for(done = 0; done < n; done += chunk)
+      streamDraw(&st, tris, n - done < chunk ? n - done : chunk);
+    streamEnd(&st);
+    secs = now_sec() - start;
+    printf("%11lu triangles: %8.2f Mtri/s in %lu buffers\n", n, n/secs/1e6, st.buffers);
+  }
+
+  free(tris);
+  ioctl(fd, VMODE, GRAPHICS_OFF);
+}
+
+
 int main(){
 
   int fd,i, FB_size;
@@ -266,7 +1582,7 @@ int main(){
 	printf("\n");
   int choice;
 
-  printf("Enter choice:\n1.Draw Triangle using FIFO\n2.Draw Triangle using DMA\nYour choice is:");
+  printf("Enter choice:\n1.Draw Triangle using FIFO\n2.Draw Triangle using DMA\n3.Benchmark DMA stream validation\n4.Benchmark local vs remote NUMA submission\n5.Benchmark streaming draw\n6.Capture 300 frames to capture.ppm\n7.Benchmark urgent vs bulk latency\n8.Benchmark interrupt vs busy-poll completion\n9.Benchmark 2D framebuffer uploads\n10.Benchmark instanced drawing\nYour choice is:");
   scanf("%d",&choice);
   switch(choice){
     //CASE to use FIFO
@@ -292,7 +1608,7 @@ k2.u_fb_base = mmap(0, FB_size*1024*1024, PROT_READ|PROT_WRITE, MAP_SHARED, fd,
     case 2:
 	{
 		int choice2;
-		printf("1.Draw 100 random triangles\n2.Draw 4 equilateral triangles\nYour choice:");
+		printf("1.Draw 100 random triangles\n2.Draw 4 equilateral triangles\n3.Draw 100 random triangles through submission ring\nYour choice:");
 		scanf("%d",&choice2);
 		switch(choice2){	
                 //Internal CASE for drawing 100 random triangles using DMA
@@ -332,12 +1648,71 @@ k2.u_fb_base = mmap(0, FB_size*1024*1024, PROT_READ|PROT_WRITE, MAP_SHARED, fd,
 			ioctl(fd, VMODE, GRAPHICS_OFF);
 			break;
  		}
+                //Internal case for drawing 100 random triangles through the shared rings
+		case 3:
+		{
+			if(ringSetup(fd))
+				break;
+			ringTriangles(fd, 100);
+			ioctl(fd, FLUSH);
+			sleep(5);
+			ioctl(fd, VMODE, GRAPHICS_OFF);
+			break;
+		}
 		default:
 			printf("Invalid Choice\n");
 			break;
                }
 	  break;
     }
+    //CASE to benchmark the DMA command validator, no device needed
+    case 3:
+	{
+		benchValidate();
+		break;
+	}
+    //CASE to compare packing DMA buffers on and off the card's NUMA node
+    case 4:
+	{
+		benchNuma(fd);
+		break;
+	}
+    //CASE to measure streaming draw throughput against input size
+    case 5:
+	{
+		benchStream(fd);
+		break;
+	}
+    //CASE to record rendered frames to disk
+    case 6:
+	{
+		captureDemo(fd, 300);
+		break;
+	}
+    //CASE to compare latency of urgent and bulk submissions
+    case 7:
+	{
+		benchPriority(fd);
+		break;
+	}
+    //CASE to compare interrupt and busy-poll completion latency
+    case 8:
+	{
+		benchPoll(fd);
+		break;
+	}
+    //CASE to measure 2D uploads into the framebuffer
+    case 9:
+	{
+		benchBlit(fd);
+		break;
+	}
+    //CASE to measure instanced draw expansion
+    case 10:
+	{
+		benchInstances(fd);
+		break;
+	}
    default:
 		printf("Invalid Option\n");
 		break;